@@ -0,0 +1,300 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <coroutine>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Asynchronous front end for a Btree. Requests are queued and return at once;
+// a pool of workers drains the queues in batches, sorts each batch by key so that
+// requests for the same leaf share one descent, and completes them through a
+// callback or by resuming an awaiting coroutine. Gets and puts go to the worker
+// picked by the hash of their key, so the requests for one key are applied in the
+// order they were submitted: a get sees the puts submitted before it and none
+// after, and the last put submitted wins. Completions run on a worker thread, in
+// no particular order relative to requests for other keys.
+template<typename TreeT, typename HashT = std::hash<typename TreeT::Key>>
+struct AsyncBtree {
+    using KeyT = typename TreeT::Key;
+    using ValueT = typename TreeT::Value;
+
+    using GetCallback = std::function<void(std::optional<ValueT>)>;
+    using PutCallback = std::function<void()>;
+    using ScanCallback = std::function<void(std::vector<std::pair<KeyT, ValueT>>)>;
+
+    struct GetRequest {
+        KeyT key;
+        GetCallback done;
+    };
+
+    struct PutRequest {
+        KeyT key;
+        ValueT value;
+        PutCallback done;
+    };
+
+    struct ScanRequest {
+        KeyT lo;
+        KeyT hi;
+        ScanCallback done;
+    };
+
+    enum class Kind : uint8_t { Get, Put };
+
+    // Requests waiting for one worker
+    struct Queue {
+        std::condition_variable cv;
+        std::vector<GetRequest> gets;
+        std::vector<PutRequest> puts;
+        // Kinds of the gets and puts in the order they were submitted
+        std::vector<Kind> order;
+        std::vector<ScanRequest> scans;
+
+        bool empty() const {
+            return gets.empty() && puts.empty() && scans.empty();
+        }
+    };
+
+    TreeT &tree;
+    std::mutex mutex;
+    std::condition_variable idle_cv;
+    // One per worker, guarded by mutex
+    std::vector<std::unique_ptr<Queue>> queues;
+    // Scans have no key to route by and take turns
+    std::atomic<std::size_t> next_scan_queue{0};
+    // Requests queued or being processed
+    std::size_t outstanding = 0;
+    bool stop = false;
+    std::vector<std::thread> workers;
+
+    // Constructor
+    explicit AsyncBtree(TreeT &tree, unsigned worker_count = std::max(1u, std::thread::hardware_concurrency()))
+        : tree(tree) {
+        for (unsigned i = 0; i < std::max(1u, worker_count); i++) {
+            queues.push_back(std::make_unique<Queue>());
+        }
+        for (auto &queue : queues) {
+            workers.emplace_back([this, &queue = *queue] { work(queue); });
+        }
+    }
+
+    // Destructor, completes all queued requests first
+    ~AsyncBtree() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        for (auto &queue : queues) {
+            queue->cv.notify_all();
+        }
+        for (auto &worker : workers) {
+            worker.join();
+        }
+    }
+
+    void async_get(const KeyT &key, GetCallback done) {
+        submit(queue_of(key), [&](Queue &queue) {
+            queue.gets.push_back({key, std::move(done)});
+            queue.order.push_back(Kind::Get);
+        });
+    }
+
+    void async_put(const KeyT &key, const ValueT &value, PutCallback done) {
+        submit(queue_of(key), [&](Queue &queue) {
+            queue.puts.push_back({key, value, std::move(done)});
+            queue.order.push_back(Kind::Put);
+        });
+    }
+
+    // Collects the entries with lo <= key <= hi
+    void async_scan(const KeyT &lo, const KeyT &hi, ScanCallback done) {
+        Queue &queue = *queues[next_scan_queue.fetch_add(1, std::memory_order_relaxed) % queues.size()];
+        submit(queue, [&](Queue &q) { q.scans.push_back({lo, hi, std::move(done)}); });
+    }
+
+    // Awaitable forms, the coroutine resumes on a worker thread
+    struct GetAwaitable {
+        AsyncBtree* self;
+        KeyT key;
+        std::optional<ValueT> result;
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle) {
+            self->async_get(key, [this, handle](std::optional<ValueT> value) {
+                result = std::move(value);
+                handle.resume();
+            });
+        }
+        std::optional<ValueT> await_resume() { return std::move(result); }
+    };
+
+    struct PutAwaitable {
+        AsyncBtree* self;
+        KeyT key;
+        ValueT value;
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle) {
+            self->async_put(key, value, [handle] { handle.resume(); });
+        }
+        void await_resume() const noexcept {}
+    };
+
+    struct ScanAwaitable {
+        AsyncBtree* self;
+        KeyT lo;
+        KeyT hi;
+        std::vector<std::pair<KeyT, ValueT>> result;
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle) {
+            self->async_scan(lo, hi, [this, handle](std::vector<std::pair<KeyT, ValueT>> entries) {
+                result = std::move(entries);
+                handle.resume();
+            });
+        }
+        std::vector<std::pair<KeyT, ValueT>> await_resume() { return std::move(result); }
+    };
+
+    GetAwaitable async_get(const KeyT &key) { return {this, key, std::nullopt}; }
+    PutAwaitable async_put(const KeyT &key, const ValueT &value) { return {this, key, value}; }
+    ScanAwaitable async_scan(const KeyT &lo, const KeyT &hi) { return {this, lo, hi, {}}; }
+
+    // Block until every request submitted so far has completed
+    void drain() {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle_cv.wait(lock, [this] { return outstanding == 0; });
+    }
+
+private:
+    Queue& queue_of(const KeyT &key) {
+        return *queues[HashT{}(key) % queues.size()];
+    }
+
+    template<typename PushFn>
+    void submit(Queue &queue, PushFn &&push) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            push(queue);
+            outstanding++;
+        }
+        queue.cv.notify_one();
+    }
+
+    // A worker takes whole batches from its own queue only, so a batch is applied
+    // before the next one for the same keys is taken. Within a batch, puts run
+    // before gets; a put of a key that an earlier get in the batch asked for starts
+    // a new run, so that the get does not see it.
+    void work(Queue &queue) {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            queue.cv.wait(lock, [this, &queue] { return stop || !queue.empty(); });
+            if (queue.empty()) {
+                return;
+            }
+            std::vector<GetRequest> get_batch;
+            std::vector<PutRequest> put_batch;
+            std::vector<Kind> order;
+            std::vector<ScanRequest> scan_batch;
+            get_batch.swap(queue.gets);
+            put_batch.swap(queue.puts);
+            order.swap(queue.order);
+            scan_batch.swap(queue.scans);
+            lock.unlock();
+
+            std::vector<GetRequest> get_run;
+            std::vector<PutRequest> put_run;
+            std::set<KeyT, typename TreeT::Comparator> got;
+            std::size_t next_get = 0;
+            std::size_t next_put = 0;
+            for (Kind kind : order) {
+                if (kind == Kind::Get) {
+                    got.insert(get_batch[next_get].key);
+                    get_run.push_back(std::move(get_batch[next_get++]));
+                    continue;
+                }
+                if (got.count(put_batch[next_put].key)) {
+                    run_puts(put_run);
+                    run_gets(get_run);
+                    got.clear();
+                }
+                put_run.push_back(std::move(put_batch[next_put++]));
+            }
+            run_puts(put_run);
+            run_gets(get_run);
+            for (auto &request : scan_batch) {
+                std::vector<std::pair<KeyT, ValueT>> entries;
+                tree.scan(request.lo, request.hi, [&entries](const KeyT &key, const ValueT &value) {
+                    entries.emplace_back(key, value);
+                    return true;
+                });
+                request.done(std::move(entries));
+            }
+
+            lock.lock();
+            outstanding -= order.size() + scan_batch.size();
+            if (outstanding == 0) {
+                idle_cv.notify_all();
+            }
+        }
+    }
+
+    void run_puts(std::vector<PutRequest> &batch) {
+        if (batch.empty()) {
+            return;
+        }
+        const auto comparator = typename TreeT::Comparator{};
+        // Stable, so the latest put of a key is applied last
+        std::stable_sort(batch.begin(), batch.end(), [&comparator](const PutRequest &a, const PutRequest &b) {
+            return comparator(a.key, b.key);
+        });
+        std::vector<std::pair<KeyT, ValueT>> entries;
+        entries.reserve(batch.size());
+        for (const auto &request : batch) {
+            entries.emplace_back(request.key, request.value);
+        }
+        tree.merge_sorted(entries.begin(), entries.end());
+        for (auto &request : batch) {
+            if (request.done) {
+                request.done();
+            }
+        }
+        batch.clear();
+    }
+
+    void run_gets(std::vector<GetRequest> &batch) {
+        if (batch.empty()) {
+            return;
+        }
+        const auto comparator = typename TreeT::Comparator{};
+        std::sort(batch.begin(), batch.end(), [&comparator](const GetRequest &a, const GetRequest &b) {
+            return comparator(a.key, b.key);
+        });
+        std::vector<KeyT> keys;
+        keys.reserve(batch.size());
+        for (const auto &request : batch) {
+            keys.push_back(request.key);
+        }
+        // Collect the values first, callbacks must not run under a leaf latch
+        std::vector<std::optional<ValueT>> values(batch.size());
+        tree.get_sorted(keys.begin(), keys.end(), [&values](std::size_t index, const ValueT* value) {
+            if (value) {
+                values[index] = *value;
+            }
+        });
+        for (std::size_t i = 0; i < batch.size(); i++) {
+            if (batch[i].done) {
+                batch[i].done(std::move(values[i]));
+            }
+        }
+        batch.clear();
+    }
+};
@@ -0,0 +1,190 @@
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <functional>
+#include <shared_mutex>
+#include <algorithm>
+#include "btree.h"
+#include "latch.h"
+#include "time_series.h"
+
+constexpr size_t kThreads = 8;
+constexpr uint64_t kKeys = 1 << 18;
+constexpr auto kDuration = std::chrono::milliseconds(500);
+
+static void print_histogram(const char* name, const LatencyHistogram& h) {
+    std::cout << "  " << name << ": count=" << h.total << " p50=" << h.percentile(0.5)
+              << "ns p99=" << h.percentile(0.99) << "ns p999=" << h.percentile(0.999)
+              << "ns max=" << h.max() << "ns\n";
+}
+
+// Latency of gets and puts with 95% reads and 5% writes on uniform random keys
+template<typename LatchT>
+static void bench_read_heavy_mix(const char* name) {
+    using Tree = Btree<uint64_t, uint64_t, std::less<uint64_t>, 64, LatchT>;
+    Tree tree;
+    for (uint64_t key = 0; key < kKeys; key += 2) {
+        tree.put(key, key);
+    }
+
+    std::vector<LatencyHistogram> reads(kThreads), writes(kThreads);
+    std::vector<std::thread> threads;
+    auto deadline = std::chrono::steady_clock::now() + kDuration;
+    for (size_t t = 0; t < kThreads; ++t) {
+        threads.emplace_back([&, t] {
+            std::mt19937_64 rng(t);
+            while (std::chrono::steady_clock::now() < deadline) {
+                for (int i = 0; i < 100; i++) {
+                    uint64_t key = rng() % kKeys;
+                    bool write = rng() % 100 < 5;
+                    uint64_t start = now_ns();
+                    if (write) {
+                        tree.put(key, key);
+                    } else {
+                        tree.get(key);
+                    }
+                    uint64_t elapsed = now_ns() - start;
+                    (write ? writes : reads)[t].add(LatencyHistogram::bucket_index(elapsed), 1);
+                }
+            }
+        });
+    }
+    for (auto& th : threads) th.join();
+
+    LatencyHistogram read_total, write_total;
+    for (size_t t = 0; t < kThreads; ++t) {
+        read_total.merge(reads[t]);
+        write_total.merge(writes[t]);
+    }
+    std::cout << name << " (95% get / 5% put, " << kThreads << " threads)\n";
+    print_histogram("get", read_total);
+    print_histogram("put", write_total);
+}
+
+// Bulk load time of sorted input by number of threads
+static void bench_bulk_load() {
+    using Tree = Btree<uint64_t, uint64_t, std::less<uint64_t>, 64>;
+    constexpr uint64_t kEntries = 1 << 22;
+    std::vector<std::pair<uint64_t, uint64_t>> entries(kEntries);
+    for (uint64_t i = 0; i < kEntries; ++i) {
+        entries[i] = {i, i};
+    }
+    std::cout << "bulk_load of " << kEntries << " entries\n";
+    for (unsigned threads = 1; threads <= std::max(1u, std::thread::hardware_concurrency()); threads *= 2) {
+        Tree tree;
+        uint64_t start = now_ns();
+        tree.bulk_load(entries.begin(), entries.end(), threads);
+        std::cout << "  " << threads << " threads: " << (now_ns() - start) / 1000000.0 << "ms\n";
+    }
+
+    std::shuffle(entries.begin(), entries.end(), std::mt19937_64(1));
+    std::cout << "bulk_load_unsorted of " << kEntries << " entries\n";
+    for (unsigned threads = 1; threads <= std::max(1u, std::thread::hardware_concurrency()); threads *= 2) {
+        Tree tree;
+        uint64_t start = now_ns();
+        tree.bulk_load_unsorted(entries.begin(), entries.end(), threads);
+        std::cout << "  " << threads << " threads: " << (now_ns() - start) / 1000000.0 << "ms\n";
+    }
+}
+
+// Applying a sorted batch to a populated tree with merge_sorted and with one put per key
+static void bench_merge_sorted() {
+    using Tree = Btree<uint64_t, uint64_t, std::less<uint64_t>, 64>;
+    constexpr uint64_t kEntries = 1 << 21;
+    std::vector<std::pair<uint64_t, uint64_t>> base(kEntries), batch(kEntries);
+    for (uint64_t i = 0; i < kEntries; ++i) {
+        base[i] = {2 * i, i};
+        batch[i] = {i, i};
+    }
+    std::cout << "sorted batch of " << kEntries << " entries into a tree of " << kEntries << "\n";
+
+    Tree merged;
+    merged.bulk_load(base.begin(), base.end());
+    uint64_t start = now_ns();
+    merged.merge_sorted(batch.begin(), batch.end());
+    std::cout << "  merge_sorted: " << (now_ns() - start) / 1000000.0 << "ms\n";
+
+    Tree single;
+    single.bulk_load(base.begin(), base.end());
+    start = now_ns();
+    for (const auto& [key, value] : batch) {
+        single.put(key, value);
+    }
+    std::cout << "  put per key: " << (now_ns() - start) / 1000000.0 << "ms\n";
+}
+
+// Points of interleaved series with increasing timestamps, by append and by put
+static void bench_time_series_append() {
+    using Tree = Btree<uint64_t, uint64_t, std::less<uint64_t>, 64>;
+    constexpr uint64_t kSeries = 1000;
+    constexpr uint64_t kPoints = 2000;
+    auto series_of = [](uint64_t key) { return key >> 40; };
+    std::cout << kSeries << " series of " << kPoints << " points\n";
+
+    Tree appended;
+    TimeSeriesAppender<Tree, decltype(series_of)> appender(appended, series_of);
+    uint64_t start = now_ns();
+    for (uint64_t time = 0; time < kPoints; ++time) {
+        for (uint64_t series = 0; series < kSeries; ++series) {
+            appender.append(series << 40 | time, time);
+        }
+    }
+    std::cout << "  append: " << (now_ns() - start) / 1000000.0 << "ms, "
+              << 100.0 * appender.hits / appender.appends << "% to the cached leaf\n";
+
+    Tree put;
+    start = now_ns();
+    for (uint64_t time = 0; time < kPoints; ++time) {
+        for (uint64_t series = 0; series < kSeries; ++series) {
+            put.put(series << 40 | time, time);
+        }
+    }
+    std::cout << "  put: " << (now_ns() - start) / 1000000.0 << "ms\n";
+}
+
+// Put latency while the tree grows from empty, with splits in put and on the
+// background thread
+static void bench_deferred_splits() {
+    using Tree = Btree<uint64_t, uint64_t, std::less<uint64_t>, 64>;
+    constexpr uint64_t kPutsPerThread = 1 << 17;
+    std::cout << "put into a growing tree (" << kThreads << " threads)\n";
+    for (bool deferred : {false, true}) {
+        Tree tree;
+        if (deferred) {
+            tree.enable_deferred_splits();
+        }
+        std::vector<LatencyHistogram> puts(kThreads);
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < kThreads; ++t) {
+            threads.emplace_back([&, t] {
+                std::mt19937_64 rng(t);
+                for (uint64_t i = 0; i < kPutsPerThread; ++i) {
+                    uint64_t key = rng();
+                    uint64_t start = now_ns();
+                    tree.put(key, key);
+                    puts[t].add(LatencyHistogram::bucket_index(now_ns() - start), 1);
+                }
+            });
+        }
+        for (auto& th : threads) th.join();
+        tree.disable_deferred_splits();
+
+        LatencyHistogram total;
+        for (const LatencyHistogram &h : puts) {
+            total.merge(h);
+        }
+        print_histogram(deferred ? "deferred splits" : "splits in put", total);
+    }
+}
+
+int main() {
+    bench_read_heavy_mix<std::shared_mutex>("std::shared_mutex");
+    bench_read_heavy_mix<WriterPreferringLatch>("WriterPreferringLatch");
+    bench_read_heavy_mix<PhaseFairLatch>("PhaseFairLatch");
+    bench_bulk_load();
+    bench_merge_sorted();
+    bench_time_series_append();
+    bench_deferred_splits();
+}
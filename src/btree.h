@@ -3,16 +3,68 @@
 #include <shared_mutex>
 #include <algorithm>
 #include <mutex>
+#include <type_traits>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <random>
+#include <utility>
+#include "latency_histogram.h"
+#include "trace.h"
+#include "range_lock.h"
 
-template<typename KeyT, typename ValueT, typename ComparatorT, std::size_t kCapacity>
+// Build with -DBTREE_LATENCY_STATS=1 to record per-operation latency histograms
+// and a count of reader descents restarted at a replaced root
+#ifndef BTREE_LATENCY_STATS
+#define BTREE_LATENCY_STATS 0
+#endif
+
+// Build with -DBTREE_TRACING=1 to record splits, root growth, root restarts of
+// readers and long latch waits into global_tracer()
+#ifndef BTREE_TRACING
+#define BTREE_TRACING 0
+#endif
+
+// Outcome of the non-blocking and deadline-bounded operations
+enum class OpStatus : uint8_t { Ok, NotFound, Busy };
+
+// Operations tracked by the latency histograms
+enum class BtreeOp : uint8_t { Get, Put, Scan, Erase, Split, Count };
+
+inline const char* btree_op_name(BtreeOp op) {
+    static const char* const names[] = {"get", "put", "scan", "erase", "split"};
+    return names[static_cast<std::size_t>(op)];
+}
+
+// Shares the private helpers of its primary tree, see indexed_table.h
+template<typename KeyT, typename ValueT, typename ComparatorT, std::size_t kCapacity, typename... IndexTs>
+struct IndexedTable;
+
+// LatchT is the reader/writer latch of every node and of the tree itself. Besides
+// std::shared_mutex, latch.h has writer-preferring and phase-fair latches.
+template<typename KeyT, typename ValueT, typename ComparatorT, std::size_t kCapacity,
+         typename LatchT = std::shared_mutex>
 struct Btree {
+    using Key = KeyT;
+    using Value = ValueT;
+    using Comparator = ComparatorT;
+
+    // Extra leaf slots that absorb inserts while a split is deferred
+    static constexpr std::size_t kLeafOverflow = kCapacity / 16 > 0 ? kCapacity / 16 : 1;
+
     struct Node {
         // Level in the tree
         uint16_t level;
         // Number of children
         uint16_t children_count;
         // Lock for each node
-        mutable std::shared_mutex mtx;
+        mutable LatchT mtx;
+        // Clock value of the last write descent that changed this subtree
+        uint64_t version = 0;
 
         // Constructor
         Node(uint16_t level, uint16_t children_count) : level(level), children_count(children_count) {}
@@ -21,9 +73,27 @@ struct Btree {
         virtual ~Node() = default;
 
         // Manual locking
+#if BTREE_TRACING
+        // Only contended acquisitions are timed
+        void lock_read() const {
+            if (!mtx.try_lock_shared()) {
+                uint64_t start = now_ns();
+                mtx.lock_shared();
+                global_tracer().latch_wait(level, start);
+            }
+        }
+        void lock_write() {
+            if (!mtx.try_lock()) {
+                uint64_t start = now_ns();
+                mtx.lock();
+                global_tracer().latch_wait(level, start);
+            }
+        }
+#else
         void lock_read() const    { mtx.lock_shared(); }
-        void unlock_read() const  { mtx.unlock_shared(); }
         void lock_write()         { mtx.lock(); }
+#endif
+        void unlock_read() const  { mtx.unlock_shared(); }
         void unlock_write()       { mtx.unlock(); }
 
         // Check if the node is a leaf
@@ -99,10 +169,16 @@ struct Btree {
     };
 
     struct LeafNode: Node {
-        // Keys
-        KeyT keys[kCapacity];
+        // Keys, the last kLeafOverflow slots are only used with deferred splits
+        KeyT keys[kCapacity + kLeafOverflow];
         // Values
-        ValueT values[kCapacity];
+        ValueT values[kCapacity + kLeafOverflow];
+        // Right neighbor, for scans
+        LeafNode* next = nullptr;
+        // Waiting for the background split thread
+        bool split_queued = false;
+        // Times the keys routed to the leaf were narrowed by a split
+        uint32_t splits = 0;
 
         // Constructor
         LeafNode() : Node(0, 0) {}
@@ -154,6 +230,25 @@ struct Btree {
             this->children_count++;
         }
 
+        // Remove a key, returns whether it was present
+        bool erase(const KeyT &key) {
+            auto [index, found] = lower_bound(key);
+            if (!found) {
+                return false;
+            }
+
+            for (uint32_t i = index + 1; i < this->children_count; i++) {
+                keys[i - 1] = keys[i];
+                values[i - 1] = values[i];
+            }
+            this->children_count--;
+            // Back under capacity, a split queued for it is no longer needed
+            if (this->children_count < kCapacity) {
+                split_queued = false;
+            }
+            return true;
+        }
+
         // Split a node
         KeyT split(LeafNode* right_neighbor) {
             int mid_key_index = this->children_count / 2;
@@ -163,6 +258,10 @@ struct Btree {
 
             this->children_count = left_count;
             right_neighbor->children_count = right_count;
+            split_queued = false;
+            splits++;
+            right_neighbor->next = next;
+            next = right_neighbor;
 
             std::copy(keys + mid_key_index + 1, keys + mid_key_index + 1 + right_count, right_neighbor->keys);
             std::copy(values + mid_key_index + 1, values + mid_key_index + 1 + right_count, right_neighbor->values);
@@ -171,212 +270,2246 @@ struct Btree {
         }
     };
 
-    // The root
-    Node* root;
+    static constexpr bool kLatencyStats = BTREE_LATENCY_STATS;
+
+    // Placeholder for the recorder when latency stats are compiled out
+    struct NoLatencyRecorder {};
+
+    // Times the enclosing scope into the histogram of an operation
+    struct LatencyScope {
+#if BTREE_LATENCY_STATS
+        const Btree* tree;
+        BtreeOp op;
+        uint64_t start;
+
+        LatencyScope(const Btree* tree, BtreeOp op) : tree(tree), op(op), start(now_ns()) {}
+        ~LatencyScope() { tree->latency.record(static_cast<std::size_t>(op), now_ns() - start); }
+#else
+        LatencyScope(const Btree*, BtreeOp) {}
+#endif
+    };
+
+    // Times a split into the latency histograms and the tracer
+    struct SplitScope {
+        LatencyScope latency_scope;
+#if BTREE_TRACING
+        uint16_t level;
+        uint64_t start;
+
+        SplitScope(const Btree* tree, uint16_t level) : latency_scope(tree, BtreeOp::Split), level(level), start(now_ns()) {}
+        ~SplitScope() { global_tracer().record(TraceEvent::Split, level, start, now_ns() - start); }
+#else
+        SplitScope(const Btree* tree, uint16_t) : latency_scope(tree, BtreeOp::Split) {}
+#endif
+    };
+
+    // The root. Writers replace it under the global lock while holding the old root
+    // latched for writing; readers re-check it after latching, see latch_root_for_read.
+    std::atomic<Node*> root{nullptr};
     // Global lock for the tree
-    mutable std::shared_mutex global_mutex;
+    mutable LatchT global_mutex;
+    // Source of node versions, advanced by every write descent under global_mutex
+    uint64_t version_clock = 0;
+    // Clock value at the last bulk_load, split_at or concat; these move entries
+    // without stamping the nodes, so diff compares everything across them
+    uint64_t rebuilt_version = 0;
+    // Clock value when writers were last held off; snapshots and checkpoints only
+    // compare against versions up to it
+    uint64_t frozen_version = 0;
+    // Advanced by split_at and concat, which free nodes and move key ranges
+    uint64_t structure_epoch = 0;
+    // Write descents that have not released their leaf yet
+    std::atomic<uint32_t> active_writers{0};
+    // Key ranges locked by transactions
+    RangeLockTable<KeyT, ComparatorT> range_locks;
+    // Per-thread latency histograms, merged on read
+    [[no_unique_address]] mutable std::conditional_t<kLatencyStats,
+        LatencyRecorder<static_cast<std::size_t>(BtreeOp::Count)>, NoLatencyRecorder> latency;
+
+    // Deferred split mode
+    std::atomic<bool> deferred_splits{false};
+    // Keys of leaves waiting to be split by split_thread
+    std::vector<KeyT> split_requests;
+    std::size_t splits_pending = 0;
+    bool split_stop = true;
+    std::mutex split_mutex;
+    std::condition_variable split_cv;
+    std::condition_variable split_done_cv;
+    std::thread split_thread;
+    // Held while split_thread is started or stopped
+    std::mutex split_control_mutex;
 
     // Constructor
-    Btree() {
-        root = nullptr;
-    }
+    Btree() {}
 
     // Destructor
     ~Btree() {
-        std::unique_lock<std::shared_mutex> g(global_mutex);
+        disable_deferred_splits();
+        std::unique_lock<LatchT> g(global_mutex);
         delete_subtree(root);
         root = nullptr;
     }
 
+    // Merged latency histogram of an operation, empty when stats are compiled out
+    LatencyHistogram latency_histogram(BtreeOp op) const {
+        if constexpr (kLatencyStats) {
+            return latency.merged(static_cast<std::size_t>(op));
+        }
+        return {};
+    }
+
+    // Descents that started over at a replaced root, 0 when stats are compiled out
+    uint64_t restart_count() const {
+        if constexpr (kLatencyStats) {
+            return latency.restart_count();
+        }
+        return 0;
+    }
+
+    // Clear all latency histograms and the restart count
+    void reset_latency_histograms() {
+        if constexpr (kLatencyStats) {
+            latency.reset();
+        }
+    }
+
     // Lookup an entry in the tree
     std::optional<ValueT> get(const KeyT &key) {
-        if (!root) {
+        LatencyScope latency_scope(this, BtreeOp::Get);
+        ValueT value;
+        if (lookup(key, value, BlockingAcquire{}) != OpStatus::Ok) {
             return std::nullopt;
         }
+        return value;
+    }
+
+    // Insert a new entry into the tree
+    void put(const KeyT &key, const ValueT &value) {
+        LatencyScope latency_scope(this, BtreeOp::Put);
+        upsert(key, value, BlockingAcquire{});
+    }
 
-        root->lock_read();
-        Node* current_node = root;
+    // Where the last append with a hint went. Keys appended with one hint must
+    // increase, and a hint is used by one thread at a time.
+    struct AppendHint {
+        LeafNode* leaf = nullptr;
+        // Upper bound of the keys routed to the leaf
+        KeyT fence{};
+        bool bounded = false;
+        // Last key appended
+        KeyT last{};
+        // Version the path to the leaf was stamped with, split count of the leaf
+        // and structure epoch of the tree when the hint was taken
+        uint64_t version = 0;
+        uint32_t splits = 0;
+        uint64_t epoch = 0;
+    };
 
-        // Lock coupling until reaching a leaf
-        while (!current_node->is_leaf()) {
-            InnerNode* current_inner_node = static_cast<InnerNode*>(current_node);
-            uint32_t pos = current_inner_node->lower_bound(key).first;
-            Node* child_node = current_inner_node->children[pos];
+    // Insert a key larger than the last one appended with hint. Goes straight to the
+    // hinted leaf if it still holds the keys up to key and has room, otherwise
+    // descends like put and moves hint to the leaf of key. Returns whether the
+    // hinted leaf took the key.
+    bool append(const KeyT &key, const ValueT &value, AppendHint &hint) {
+        LatencyScope latency_scope(this, BtreeOp::Put);
+        if (hint.leaf && append_to_hint(key, value, hint)) {
+            return true;
+        }
 
-            child_node->lock_read();
-            current_node->unlock_read();
+        Fence fence;
+        LeafNode* leafNode = latch_leaf_for_update(key, kCapacity, BlockingAcquire{}, &fence);
+        leafNode->insert(key, value);
+        hint = AppendHint{leafNode, fence.key, fence.bounded, key, leafNode->version, leafNode->splits, structure_epoch};
+        leafNode->unlock_write();
+        finish_write();
+        return false;
+    }
 
-            current_node = child_node;
+    // Remove an entry, returns whether it was present. Leaves are not merged, so
+    // erasing can leave empty leaves behind until puts refill them.
+    bool erase(const KeyT &key) {
+        LatencyScope latency_scope(this, BtreeOp::Erase);
+        if (!root.load(std::memory_order_acquire)) {
+            return false;
         }
+        // Never splits the leaf, it cannot hold this many entries
+        LeafNode* leafNode = latch_leaf_for_update(key, kCapacity + kLeafOverflow + 1, BlockingAcquire{});
+        bool erased = leafNode->erase(key);
+        leafNode->unlock_write();
+        finish_write();
+        return erased;
+    }
 
-        LeafNode* leafNode = static_cast<LeafNode*>(current_node);
-        auto [pos, found] = leafNode->lower_bound(key);
-        if (!found) {
-            leafNode->unlock_read();
-            return std::nullopt;
+    // Visit the entries with lo <= key <= hi in key order until fn(key, value)
+    // returns false. fn runs under the leaf latch and must not modify the tree.
+    template<typename Fn>
+    void scan(const KeyT &lo, const KeyT &hi, Fn &&fn) {
+        LatencyScope latency_scope(this, BtreeOp::Scan);
+        const ComparatorT comparator{};
+        LeafNode* leafNode = latch_leaf_for_read(lo);
+        if (!leafNode) {
+            return;
         }
 
-        ValueT res = leafNode->values[pos];
-        current_node->unlock_read();
+        uint32_t pos = leafNode->lower_bound(lo).first;
+        while (true) {
+            for (; pos < leafNode->children_count; pos++) {
+                if (comparator(hi, leafNode->keys[pos]) || !fn(leafNode->keys[pos], leafNode->values[pos])) {
+                    leafNode->unlock_read();
+                    return;
+                }
+            }
 
-        return res;
+            // Lock coupling to the right neighbor
+            LeafNode* next_leaf = leafNode->next;
+            if (!next_leaf) {
+                leafNode->unlock_read();
+                return;
+            }
+            next_leaf->lock_read();
+            leafNode->unlock_read();
+            leafNode = next_leaf;
+            pos = 0;
+        }
     }
 
-    // Insert a new entry into the tree
-    void put(const KeyT &key, const ValueT &value) {
-        // Global lock for cases where the root is updated
-        global_mutex.lock();
+    // Forward cursor that holds no latch between steps. It copies one leaf at a time
+    // and moves on by descending to the key after its last one, so it stays valid
+    // while the tree changes; entries inserted behind the cursor are not seen.
+    struct Cursor {
+        Btree* tree;
+        // Entries of the current leaf from the cursor position on
+        std::vector<std::pair<KeyT, ValueT>> buffer;
+        std::size_t index = 0;
+        // No leaf after the buffered one
+        bool last_leaf = true;
 
-        // Empty tree
-        if (!root) {
-            auto* leaf = new LeafNode();
-            root = leaf;
-            leaf->insert(key, value);
-            global_mutex.unlock();
+        explicit Cursor(Btree* tree) : tree(tree) {}
 
-            return;
+        bool valid() const { return index < buffer.size(); }
+        const KeyT& key() const { return buffer[index].first; }
+        const ValueT& value() const { return buffer[index].second; }
+
+        void next() {
+            if (++index == buffer.size() && !last_leaf) {
+                KeyT after = buffer.back().first;
+                load(after, false);
+            }
         }
-        
-        const ComparatorT comparator{};
-        root->lock_write();
-        Node* current_node = root;
 
-        if (current_node->is_leaf()) {
-            LeafNode* leafNode = static_cast<LeafNode*>(current_node);
-            // Need to split the node
-            if (kCapacity <= leafNode->children_count) {
-                LeafNode* right_neighbor_node;
-                InnerNode* new_root;
-                right_neighbor_node = new LeafNode();
-                new_root = new InnerNode();
+        // Skip the rest of the buffered leaf
+        void next_leaf() {
+            index = buffer.size() - 1;
+            next();
+        }
 
-                right_neighbor_node->lock_write();
-                
-                KeyT separator_key = leafNode->split(right_neighbor_node);
-                
-                new_root->lock_write();
+        // Move to the first entry with a key >= key. Stays within the buffered leaf if
+        // it can, otherwise descends from the root.
+        void seek(const KeyT &key) {
+            const ComparatorT comparator{};
+            if (valid() && !comparator(buffer.back().first, key)) {
+                auto it = std::lower_bound(buffer.begin() + index, buffer.end(), key,
+                    [&comparator](const std::pair<KeyT, ValueT> &entry, const KeyT &k) {
+                        return comparator(entry.first, k);
+                    });
+                index = it - buffer.begin();
+                return;
+            }
+            load(key, true);
+        }
 
-                // Create a new root
-                InnerNode* parent_node = new_root;
+        // Buffer the entries >= key (or > key) of the first leaf that has any
+        void load(const KeyT &key, bool inclusive) {
+            fill(tree->latch_leaf_for_read(key), &key, inclusive);
+        }
 
-                parent_node->level = 1;
-                parent_node->children_count = 1;
-                parent_node->children[0] = root;
-                parent_node->insert_split(separator_key, right_neighbor_node);
-                parent_node->unlock_write();
+        // Same, starting at a latched leaf; without a key from its first entry on
+        void fill(LeafNode* leafNode, const KeyT* key, bool inclusive) {
+            buffer.clear();
+            index = 0;
+            last_leaf = true;
+            while (leafNode) {
+                uint32_t pos = 0;
+                if (key) {
+                    auto [index_found, found] = leafNode->lower_bound(*key);
+                    pos = found && !inclusive ? index_found + 1 : index_found;
+                }
+                for (; pos < leafNode->children_count; pos++) {
+                    buffer.emplace_back(leafNode->keys[pos], leafNode->values[pos]);
+                }
+                LeafNode* next_leaf = leafNode->next;
+                if (!buffer.empty() || !next_leaf) {
+                    last_leaf = !next_leaf;
+                    leafNode->unlock_read();
+                    return;
+                }
+                next_leaf->lock_read();
+                leafNode->unlock_read();
+                leafNode = next_leaf;
+            }
+        }
+    };
 
-                root = new_root;
-                global_mutex.unlock();
+    // Cursor at the first entry with a key >= key
+    Cursor cursor(const KeyT &key) {
+        Cursor c(this);
+        c.load(key, true);
+        return c;
+    }
 
-                if (comparator(separator_key, key)) {
-                    leafNode = right_neighbor_node;
-                    current_node->unlock_write();
-                    current_node = right_neighbor_node;
-                } 
-                else {
-                    right_neighbor_node->unlock_write();
+    // Cursor at the smallest entry
+    Cursor cursor() {
+        Cursor c(this);
+        c.fill(latch_leftmost_leaf(), nullptr, true);
+        return c;
+    }
+
+    // Most keys a transaction can write, so that a leaf too small to be split
+    // always has room for them
+    static constexpr std::size_t kMaxTransactionWrites = kCapacity - 2;
+
+    // Writes to several keys that are applied all together or not at all. Reads see
+    // the transaction's own writes and remember the version of the leaf they read;
+    // commit fails if one of those leaves changed meanwhile. Range locks keep other
+    // writers out of key ranges until the transaction ends. Use a transaction once.
+    struct Transaction {
+        // A read and the version of its leaf, found_leaf is false on an empty tree
+        struct Read {
+            KeyT key;
+            uint64_t version;
+            bool found_leaf;
+        };
+
+        Btree* tree;
+        std::vector<std::pair<KeyT, ValueT>> writes;
+        std::vector<Read> reads;
+
+        explicit Transaction(Btree* tree) : tree(tree) {}
+        Transaction(const Transaction &) = delete;
+        Transaction& operator=(const Transaction &) = delete;
+
+        // Destructor, an uncommitted transaction is aborted
+        ~Transaction() {
+            abort();
+        }
+
+        std::optional<ValueT> get(const KeyT &key) {
+            const ComparatorT comparator{};
+            for (auto it = writes.rbegin(); it != writes.rend(); ++it) {
+                if (!comparator(it->first, key) && !comparator(key, it->first)) {
+                    return it->second;
                 }
+            }
 
-                leafNode->insert(key, value);
-                current_node->unlock_write();
+            LeafNode* leafNode = tree->latch_leaf_for_read(key);
+            if (!leafNode) {
+                reads.push_back({key, 0, false});
+                return std::nullopt;
             }
-            else {
-                global_mutex.unlock();
-                leafNode->insert(key, value);
-                current_node->unlock_write();
+            reads.push_back({key, leafNode->version, true});
+            auto [pos, found] = leafNode->lower_bound(key);
+            std::optional<ValueT> value;
+            if (found) {
+                value = leafNode->values[pos];
             }
-            return;
+            leafNode->unlock_read();
+            return value;
         }
-        else {
-            InnerNode* innerNode = static_cast<InnerNode*>(current_node);
-            // Need to split the node
-            if (kCapacity <= innerNode->children_count) {
-                InnerNode* right_neighbor_node;
-                InnerNode* new_root;
-                right_neighbor_node = new InnerNode();
-                new_root = new InnerNode();
 
-                right_neighbor_node->lock_write();
-                KeyT separator_key = innerNode->split(right_neighbor_node);
-                right_neighbor_node->level = innerNode->level;
+        void put(const KeyT &key, const ValueT &value) {
+            writes.emplace_back(key, value);
+        }
 
-                if (comparator(separator_key, key)) {
-                    current_node->unlock_write();
-                    current_node = right_neighbor_node;
-                } 
-                else {
-                    right_neighbor_node->unlock_write();
+        // Lock the keys lo <= key <= hi until the transaction ends: other writers
+        // wait, other transactions writing there fail to commit. Returns false if
+        // another transaction holds an overlapping range; abort and retry then.
+        bool lock_range(const KeyT &lo, const KeyT &hi) {
+            return tree->lock_range(lo, hi, this);
+        }
+
+        // Scan with phantom protection: locks [lo, hi] and visits its entries like
+        // Btree::scan. The transaction's own writes are not visited. Returns false
+        // if the range could not be locked.
+        template<typename Fn>
+        bool scan(const KeyT &lo, const KeyT &hi, Fn &&fn) {
+            if (!lock_range(lo, hi)) {
+                return false;
+            }
+            tree->scan(lo, hi, std::forward<Fn>(fn));
+            return true;
+        }
+
+        // Apply the writes, later writes of a key win, and end the transaction.
+        // Returns false and applies nothing if a read is no longer valid, a key is
+        // in a range locked by another transaction or more than
+        // kMaxTransactionWrites keys are written.
+        bool commit() {
+            bool committed = tree->commit_transaction(*this);
+            abort();
+            return committed;
+        }
+
+        // Drop the writes and release the range locks
+        void abort() {
+            writes.clear();
+            reads.clear();
+            if (!tree->range_locks.empty()) {
+                tree->range_locks.unlock_all(this);
+            }
+        }
+    };
+
+    Transaction transaction() {
+        return Transaction(this);
+    }
+
+    // Lookup keys sorted in ascending order. Keys that fall into the same leaf share
+    // one descent. Calls fn(index, value) with a null value for missing keys, under
+    // the leaf latch.
+    template<typename KeyIt, typename Fn>
+    void get_sorted(KeyIt first, KeyIt last, Fn &&fn) {
+        const ComparatorT comparator{};
+        std::size_t index = 0;
+        while (first != last) {
+            LeafNode* leafNode = latch_leaf_for_read(*first);
+            if (!leafNode) {
+                for (; first != last; ++first) {
+                    fn(index++, static_cast<const ValueT*>(nullptr));
                 }
+                return;
+            }
 
-                new_root->lock_write();
+            // Keys up to the largest key of the leaf are routed to this leaf as well
+            do {
+                auto [pos, found] = leafNode->lower_bound(*first);
+                fn(index++, found ? &leafNode->values[pos] : static_cast<const ValueT*>(nullptr));
+                ++first;
+            } while (first != last && leafNode->children_count > 0 &&
+                     !comparator(leafNode->keys[leafNode->children_count - 1], *first));
+            leafNode->unlock_read();
+        }
+    }
 
-                // Create a new root
-                InnerNode* parent_node = new_root;
-                parent_node->level = innerNode->level + 1;
-                parent_node->children_count = 1;
-                parent_node->children[0] = root;
-                root = new_root;
-                parent_node->insert_split(separator_key, right_neighbor_node);
-                parent_node->unlock_write();
+    // Merge (key, value) pairs sorted by key into the tree, later duplicates win.
+    // There is one descent per parent of leaves: the entries routed to a leaf are
+    // merged with it in one pass, and if they do not fit the result is spread over
+    // new leaves whose separators all go into the parent at once.
+    template<typename It>
+    void merge_sorted(It first, It last) {
+        const ComparatorT comparator{};
+        std::vector<std::pair<KeyT, ValueT>> merged;
+        while (first != last) {
+            Fence fence;
+            InnerNode* parent = latch_parent_for_write(first->first, fence);
+            if (parent && !range_locks.empty()) {
+                parent->unlock_write();
+                finish_write();
+                parent = nullptr;
             }
-            global_mutex.unlock();
-            // Lock coupling
-            while (true) {
-                innerNode = static_cast<InnerNode*>(current_node);
-                uint32_t pos = innerNode->lower_bound(key).first;
-                Node* child_node = innerNode->children[pos];
-                child_node->lock_write();
-
-                if (innerNode->level == 1) {
-                    LeafNode* child_node_leaf = static_cast<LeafNode*>(child_node);
-                    // Need to split the node
-                    if (kCapacity <= child_node_leaf->children_count) {
-                        LeafNode* right_neighbor_node;
-                        right_neighbor_node = new LeafNode();
-                        right_neighbor_node->lock_write();
-                        KeyT separator_key = child_node_leaf->split(right_neighbor_node);
-
-                        if (comparator(separator_key, key)) {
-                            child_node_leaf->unlock_write();
-                            child_node_leaf = right_neighbor_node;
-                        } 
+            if (!parent) {
+                // The root is still a leaf, or put has to check the range locks
+                put(first->first, first->second);
+                ++first;
+                continue;
+            }
+
+            // Stop at a full parent, the next descent splits it
+            while (first != last && parent->children_count < kCapacity &&
+                   (!fence.bounded || !comparator(fence.key, first->first))) {
+                uint32_t pos = parent->lower_bound(first->first).first;
+                const KeyT* leaf_fence = pos + 1u < parent->children_count ? &parent->keys[pos]
+                                         : fence.bounded ? &fence.key : nullptr;
+                LeafNode* leafNode = static_cast<LeafNode*>(parent->children[pos]);
+                leafNode->lock_write();
+                leafNode->version = parent->version;
+
+                // The parent has room for this many leaves in place of this one
+                std::size_t limit = (kCapacity - parent->children_count + 1) * kCapacity;
+                merged.clear();
+                uint32_t i = 0;
+                while (true) {
+                    bool take_new = first != last && merged.size() + (leafNode->children_count - i) < limit &&
+                                    (!leaf_fence || !comparator(*leaf_fence, first->first));
+                    bool take_old = i < leafNode->children_count;
+                    if (take_new && take_old) {
+                        if (comparator(leafNode->keys[i], first->first)) {
+                            take_new = false;
+                        }
+                        else if (!comparator(first->first, leafNode->keys[i])) {
+                            // Replaced by the new entry
+                            i++;
+                            continue;
+                        }
+                    }
+                    if (take_new) {
+                        if (!merged.empty() && !comparator(merged.back().first, first->first)) {
+                            merged.back().second = first->second;
+                        }
                         else {
-                            right_neighbor_node->unlock_write();
+                            merged.emplace_back(first->first, first->second);
                         }
-                        innerNode->insert_split(separator_key, right_neighbor_node);
+                        ++first;
+                    }
+                    else if (take_old) {
+                        merged.emplace_back(leafNode->keys[i], leafNode->values[i]);
+                        i++;
+                    }
+                    else {
+                        break;
                     }
+                }
 
-                    child_node_leaf->insert(key, value);
-                    current_node->unlock_write();
-                    child_node_leaf->unlock_write();
+                if (merged.size() <= kCapacity) {
+                    store_entries(leafNode, merged.data(), merged.size());
+                }
+                else {
+                    SplitScope split_scope(this, leafNode->level);
+                    spread_entries(parent, pos, leafNode, merged);
+                }
+                leafNode->unlock_write();
+            }
+            parent->unlock_write();
+            finish_write();
+        }
+    }
 
-                    return;
+    // Build the tree bottom-up from (key, value) pairs sorted by unique keys, using
+    // up to thread_count threads. Only works on an empty tree, returns false otherwise.
+    template<typename It>
+    bool bulk_load(It first, It last, unsigned thread_count = std::thread::hardware_concurrency()) {
+        std::size_t n = static_cast<std::size_t>(last - first);
+        if (n == 0) {
+            return !root;
+        }
+        thread_count = std::max(1u, thread_count);
+
+        // Leaves, each chunk of them built and chained by its own thread
+        std::size_t level_count = (n + kCapacity - 1) / kCapacity;
+        std::vector<Node*> level(level_count);
+        std::vector<KeyT> max_keys(level_count);
+        std::vector<std::size_t> chunk_starts;
+        parallel_for(level_count, thread_count, [&](std::size_t begin, std::size_t end) {
+            LeafNode* previous = nullptr;
+            for (std::size_t i = begin; i < end; i++) {
+                auto* leaf = new LeafNode();
+                std::size_t count = std::min<std::size_t>(kCapacity, n - i * kCapacity);
+                It entry = first + i * kCapacity;
+                for (std::size_t j = 0; j < count; j++, ++entry) {
+                    leaf->keys[j] = entry->first;
+                    leaf->values[j] = entry->second;
                 }
-                
-                InnerNode* child_node_inner = static_cast<InnerNode*>(child_node);
-                // Need to split the node
-                if (kCapacity <= child_node_inner->children_count) {
-                    InnerNode* right_neighbor_node;
-                    right_neighbor_node = new InnerNode();
-                    right_neighbor_node->lock_write();
-                    KeyT separator_key = child_node_inner->split(right_neighbor_node);
-                    right_neighbor_node->level = child_node_inner->level;
+                leaf->children_count = static_cast<uint16_t>(count);
+                if (previous) {
+                    previous->next = leaf;
+                }
+                previous = leaf;
+                level[i] = leaf;
+                max_keys[i] = leaf->keys[count - 1];
+            }
+        }, &chunk_starts);
 
-                    if (comparator(separator_key, key)) {
-                        child_node_inner->unlock_write();
-                        child_node_inner = static_cast<InnerNode*>(right_neighbor_node);
-                    } 
-                    else {
-                        right_neighbor_node->unlock_write();
+        // Stitch the leaf chains of neighboring chunks
+        for (std::size_t start : chunk_starts) {
+            if (start > 0) {
+                static_cast<LeafNode*>(level[start - 1])->next = static_cast<LeafNode*>(level[start]);
+            }
+        }
+
+        // Inner levels, the largest key of each child is its separator
+        uint16_t height = 1;
+        while (level.size() > 1) {
+            std::size_t parent_count = (level.size() + kCapacity - 1) / kCapacity;
+            std::vector<Node*> parents(parent_count);
+            std::vector<KeyT> parent_max_keys(parent_count);
+            parallel_for(parent_count, thread_count, [&](std::size_t begin, std::size_t end) {
+                for (std::size_t i = begin; i < end; i++) {
+                    auto* inner = new InnerNode();
+                    inner->level = height;
+                    std::size_t count = std::min<std::size_t>(kCapacity, level.size() - i * kCapacity);
+                    for (std::size_t j = 0; j < count; j++) {
+                        inner->children[j] = level[i * kCapacity + j];
+                        if (j + 1 < count) {
+                            inner->keys[j] = max_keys[i * kCapacity + j];
+                        }
                     }
-                    innerNode->insert_split(separator_key, right_neighbor_node);
+                    inner->children_count = static_cast<uint16_t>(count);
+                    parents[i] = inner;
+                    parent_max_keys[i] = max_keys[i * kCapacity + count - 1];
                 }
-                current_node->unlock_write();
-                current_node = child_node_inner;
+            });
+            level.swap(parents);
+            max_keys.swap(parent_max_keys);
+            height++;
+        }
+
+        std::lock_guard<LatchT> lock(global_mutex);
+        if (root) {
+            delete_subtree(level[0]);
+            return false;
+        }
+        root = level[0];
+        rebuilt_version = ++version_clock;
+        return true;
+    }
+
+    // Bulk load from (key, value) pairs in any order. A copy is sorted on up to
+    // thread_count threads; of pairs with the same key the last one wins. Only works
+    // on an empty tree, returns false otherwise.
+    template<typename It>
+    bool bulk_load_unsorted(It first, It last, unsigned thread_count = std::thread::hardware_concurrency()) {
+        if (root) {
+            return false;
+        }
+        thread_count = std::max(1u, thread_count);
+        std::vector<std::pair<KeyT, ValueT>> entries(first, last);
+        parallel_stable_sort(entries, thread_count);
+        keep_last_of_equal_keys(entries);
+        return bulk_load(entries.begin(), entries.end(), thread_count);
+    }
+
+    // Move all keys >= key into a new tree. Cuts the nodes along one root-to-leaf
+    // path, so it takes O(log n). Must not run concurrently with other operations
+    // on this tree.
+    std::unique_ptr<Btree> split_at(const KeyT &key) {
+        std::lock_guard<LatchT> lock(global_mutex);
+        auto right = std::make_unique<Btree>();
+        if (!root) {
+            return right;
+        }
+
+        structure_epoch++;
+        auto [left_root, right_root] = cut(root, key);
+        root = collapse_root(left_root);
+        right->root = collapse_root(right_root);
+        rebuilt_version = ++version_clock;
+        right->version_clock = version_clock;
+        right->rebuilt_version = version_clock;
+        // The last leaf on the left still points into the right tree
+        if (LeafNode* last = rightmost_leaf(root)) {
+            last->next = nullptr;
+        }
+        return right;
+    }
+
+    // Append all entries of other, whose keys must all be greater than the keys in
+    // this tree; returns false and changes nothing otherwise. Links the two trees
+    // along one spine in O(log n). Must not run concurrently with other operations
+    // on either tree.
+    bool concat(Btree &&other) {
+        std::scoped_lock lock(global_mutex, other.global_mutex);
+        if (!other.root) {
+            return true;
+        }
+
+        // Leaves emptied by erase on either side are skipped
+        const ComparatorT comparator{};
+        const KeyT* left_max = root ? max_key(root) : nullptr;
+        LeafNode* right_min = leftmost_leaf(other.root);
+        while (right_min && right_min->children_count == 0) {
+            right_min = right_min->next;
+        }
+        if (left_max && right_min && !comparator(*left_max, right_min->keys[0])) {
+            return false;
+        }
+
+        structure_epoch++;
+        other.structure_epoch++;
+        trim_empty_right_edge();
+        Node* left = root;
+        if (!left || (left->is_leaf() && left->children_count == 0)) {
+            delete_subtree(left);
+            root = other.root.exchange(nullptr);
+            version_clock = std::max(version_clock, other.version_clock);
+            rebuilt_version = ++version_clock;
+            return true;
+        }
+
+        LeafNode* last = rightmost_leaf(root);
+        LeafNode* first = leftmost_leaf(other.root);
+
+        // The largest key on the left separates the two trees
+        KeyT separator = last->keys[last->children_count - 1];
+        Node* right = other.root.exchange(nullptr);
+        last->next = first;
+        version_clock = std::max(version_clock, other.version_clock);
+        rebuilt_version = ++version_clock;
+
+        if (left->level == right->level) {
+            root = make_root(left, separator, right);
+        }
+        else if (left->level > right->level) {
+            auto [split_key, sibling] = attach_rightmost(static_cast<InnerNode*>(left), separator, right);
+            root = sibling ? make_root(left, split_key, sibling) : left;
+        }
+        else {
+            Node* sibling = attach_leftmost(static_cast<InnerNode*>(right), separator, left);
+            root = sibling ? make_root(sibling, separator, right) : right;
+        }
+        return true;
+    }
+
+    // Copy of the tree for diff. Waits once for running writes to finish, to fix the
+    // version the copy is taken at, then copies the leaves one at a time under a
+    // read latch while writers go on, so a writer waits for at most one leaf copy.
+    // Takes O(n) time and memory. Writes made meanwhile may or may not be in the
+    // copy; they carry newer versions, so a later diff against it compares them.
+    // The copy keeps the leaf routing and versions of the tree.
+    std::unique_ptr<Btree> snapshot() {
+        auto copy = std::make_unique<Btree>();
+        lock_global_drained();
+        frozen_version = version_clock;
+        copy->version_clock = version_clock;
+        copy->rebuilt_version = rebuilt_version;
+        global_mutex.unlock();
+
+        // Copied leaves and the fences they had in the tree
+        std::vector<Node*> level;
+        std::vector<Fence> fences;
+        Fence fence;
+        std::optional<KeyT> after;
+        LeafNode* previous = nullptr;
+        while (LeafNode* source = latch_leaf_above(after ? &*after : nullptr, fence)) {
+            auto* leaf = new LeafNode();
+            std::copy(source->keys, source->keys + source->children_count, leaf->keys);
+            std::copy(source->values, source->values + source->children_count, leaf->values);
+            leaf->children_count = source->children_count;
+            leaf->version = source->version;
+            source->unlock_read();
+            if (previous) {
+                previous->next = leaf;
+            }
+            previous = leaf;
+            level.push_back(leaf);
+            fences.push_back(fence);
+            if (!fence.bounded) {
+                break;
             }
+            after = fence.key;
         }
+
+        // Inner levels, each child's fence is its separator and a parent carries
+        // the newest version below it
+        uint16_t height = 1;
+        while (level.size() > 1) {
+            std::vector<Node*> parents;
+            std::vector<Fence> parent_fences;
+            for (std::size_t i = 0; i < level.size(); i += kCapacity) {
+                auto* inner = new InnerNode();
+                inner->level = height;
+                std::size_t count = std::min<std::size_t>(kCapacity, level.size() - i);
+                for (std::size_t j = 0; j < count; j++) {
+                    inner->children[j] = level[i + j];
+                    inner->version = std::max(inner->version, level[i + j]->version);
+                    if (j + 1 < count) {
+                        inner->keys[j] = fences[i + j].key;
+                    }
+                }
+                inner->children_count = static_cast<uint16_t>(count);
+                parents.push_back(inner);
+                parent_fences.push_back(fences[i + count - 1]);
+            }
+            level.swap(parents);
+            fences.swap(parent_fences);
+            height++;
+        }
+        if (!level.empty()) {
+            copy->root = level[0];
+        }
+        return copy;
     }
-private:
+
+    // Report the entries that differ between two snapshots of the same tree, older
+    // taken first, as fn(key, old_value, new_value) in key order, with a null value
+    // for the side that lacks the key. Subtrees of newer whose version predates
+    // older are skipped, so the cost follows the size of the change. Neither tree may
+    // be modified meanwhile.
+    template<typename Fn, typename EqualT = std::equal_to<ValueT>>
+    static void diff(Btree &older, Btree &newer, Fn &&fn, EqualT equal = {}) {
+        // Versions up to base are already contained in older
+        uint64_t base = newer.rebuilt_version > older.version_clock ? 0 : older.version_clock;
+        Cursor old_cursor(&older);
+        if (!newer.root) {
+            diff_leaf(nullptr, nullptr, nullptr, old_cursor, fn, equal);
+            return;
+        }
+        auto diff_changed = [&](const LeafNode &leaf, const KeyT* lo, const KeyT* hi) {
+            diff_leaf(&leaf, lo, hi, old_cursor, fn, equal);
+        };
+        visit_changed(newer.root, nullptr, nullptr, base, diff_changed);
+    }
+
+    // Outcome of visit_changed_leaves
+    struct ChangeSet {
+        // Clock value of the tree during the visit
+        uint64_t version;
+        // Every leaf was visited
+        bool complete;
+    };
+
+    // Calls fn(leaf, lo, hi) in key order for every leaf changed after version since,
+    // where (lo, hi] are the keys routed to the leaf and null bounds are open. Writers
+    // are held off as in snapshot. Visits every leaf if since is 0 or the tree was
+    // rebuilt after since.
+    template<typename Fn>
+    ChangeSet visit_changed_leaves(uint64_t since, Fn &&fn) {
+        Frozen frozen = hold_writers();
+        ChangeSet changes{frozen.version, since == 0 || frozen.rebuilt_version > since};
+        if (frozen.root) {
+            visit_changed(frozen.root, nullptr, nullptr, changes.complete ? 0 : since, fn);
+            frozen.root->unlock_read();
+        }
+        return changes;
+    }
+
+    // Like visit_changed_leaves, but skips the leaves routed keys up to *after, if
+    // after is not null, and stops once fn returns false. Visiting a large change
+    // in several calls lets writers run in between.
+    template<typename Fn>
+    ChangeSet visit_changed_leaves_after(uint64_t since, const KeyT* after, Fn &&fn) {
+        Frozen frozen = hold_writers();
+        ChangeSet changes{frozen.version, since == 0 || frozen.rebuilt_version > since};
+        if (frozen.root) {
+            visit_changed_after(frozen.root, nullptr, nullptr, changes.complete ? 0 : since, after, fn);
+            frozen.root->unlock_read();
+        }
+        return changes;
+    }
+
+    // Calls fn(lo, hi, leaves, entries) in key order for every parent of leaves
+    // changed after version since, where (lo, hi] are the keys routed to it and null
+    // bounds are open. entries is estimated from the fill of its middle leaf, the
+    // other leaves are not read. A tree that is a single leaf is reported as one
+    // parent with the exact count. Writers are held off and everything is visited as
+    // in visit_changed_leaves.
+    template<typename Fn>
+    ChangeSet visit_changed_parents(uint64_t since, Fn &&fn) {
+        Frozen frozen = hold_writers();
+        ChangeSet changes{frozen.version, since == 0 || frozen.rebuilt_version > since};
+        if (frozen.root) {
+            visit_changed_parents(frozen.root, nullptr, nullptr, changes.complete ? 0 : since, fn);
+            frozen.root->unlock_read();
+        }
+        return changes;
+    }
+
+    // Estimate the number of entries with lo <= key <= hi from the nodes on the paths
+    // to lo and hi: whole subtrees between the paths are counted by the average
+    // fan-out seen on the paths, the leaves at the ends exactly. Exact when lo and
+    // hi share a leaf.
+    std::size_t approx_count(const KeyT &lo, const KeyT &hi) {
+        const ComparatorT comparator{};
+        if (comparator(hi, lo)) {
+            return 0;
+        }
+        Node* node = latch_root_for_read(BlockingAcquire{});
+        if (!node) {
+            return 0;
+        }
+
+        // The paths share the nodes down to the first one where they part
+        while (!node->is_leaf()) {
+            auto* innerNode = static_cast<InnerNode*>(node);
+            uint32_t pos = innerNode->lower_bound(lo).first;
+            if (pos != innerNode->lower_bound(hi).first) {
+                break;
+            }
+            Node* child_node = innerNode->children[pos];
+            child_node->lock_read();
+            node->unlock_read();
+            node = child_node;
+        }
+        if (node->is_leaf()) {
+            auto* leafNode = static_cast<LeafNode*>(node);
+            std::size_t count = leaf_upper_bound(leafNode, hi) - leafNode->lower_bound(lo).first;
+            node->unlock_read();
+            return count;
+        }
+
+        // Per level: children seen and nodes seen, for the average fan-out, and
+        // children wholly inside the range
+        uint16_t split_level = node->level;
+        std::vector<double> children(split_level + 1), nodes(split_level + 1), inside(split_level + 1);
+        auto* split_node = static_cast<InnerNode*>(node);
+        uint32_t pos_lo = split_node->lower_bound(lo).first;
+        uint32_t pos_hi = split_node->lower_bound(hi).first;
+        children[split_level] += split_node->children_count;
+        nodes[split_level] += 1;
+        inside[split_level] += pos_hi - pos_lo - 1;
+        Node* lo_node = split_node->children[pos_lo];
+        Node* hi_node = split_node->children[pos_hi];
+        lo_node->lock_read();
+        hi_node->lock_read();
+        split_node->unlock_read();
+
+        // Entries right of lo on its path, then left of hi on its path
+        double leaf_entries = 0;
+        for (bool lo_side : {true, false}) {
+            node = lo_side ? lo_node : hi_node;
+            const KeyT &key = lo_side ? lo : hi;
+            while (!node->is_leaf()) {
+                auto* innerNode = static_cast<InnerNode*>(node);
+                uint32_t pos = innerNode->lower_bound(key).first;
+                children[node->level] += innerNode->children_count;
+                nodes[node->level] += 1;
+                inside[node->level] += lo_side ? innerNode->children_count - pos - 1 : pos;
+                Node* child_node = innerNode->children[pos];
+                child_node->lock_read();
+                node->unlock_read();
+                node = child_node;
+            }
+            auto* leafNode = static_cast<LeafNode*>(node);
+            children[0] += leafNode->children_count;
+            nodes[0] += 1;
+            leaf_entries += lo_side ? leafNode->children_count - leafNode->lower_bound(lo).first
+                                    : leaf_upper_bound(leafNode, hi);
+            node->unlock_read();
+        }
+
+        // A child of a level l node holds about subtree_size entries
+        double estimate = leaf_entries;
+        double subtree_size = 1;
+        for (uint16_t level = 1; level <= split_level; level++) {
+            subtree_size *= children[level - 1] / nodes[level - 1];
+            estimate += inside[level] * subtree_size;
+        }
+        return static_cast<std::size_t>(estimate + 0.5);
+    }
+
+    // Draw up to k entries with lo <= key <= hi, uniformly at random with
+    // replacement. Each draw descends once, picking among the children in range
+    // uniformly, and is kept with a probability that evens out the fill of the
+    // nodes it passed below the point where the paths to lo and hi part. Returns
+    // fewer entries if too many draws are rejected, as for an empty range.
+    template<typename RngT>
+    std::vector<std::pair<KeyT, ValueT>> sample(const KeyT &lo, const KeyT &hi, std::size_t k, RngT &rng) {
+        // Expected draws per entry are about the inverse fill to the tree height
+        constexpr std::size_t kMaxDrawsPerEntry = 256;
+        const ComparatorT comparator{};
+        std::vector<std::pair<KeyT, ValueT>> entries;
+        std::uniform_real_distribution<double> coin(0.0, 1.0);
+        for (std::size_t draw = 0; entries.size() < k && draw < k * kMaxDrawsPerEntry; draw++) {
+            if (comparator(hi, lo)) {
+                break;
+            }
+            Node* node = latch_root_for_read(BlockingAcquire{});
+            if (!node) {
+                break;
+            }
+            bool parted = false;
+            double keep = 1;
+            while (!node->is_leaf()) {
+                auto* innerNode = static_cast<InnerNode*>(node);
+                uint32_t pos_lo = innerNode->lower_bound(lo).first;
+                uint32_t pos_hi = innerNode->lower_bound(hi).first;
+                if (parted) {
+                    keep *= static_cast<double>(pos_hi - pos_lo + 1) / kCapacity;
+                }
+                parted = parted || pos_lo != pos_hi;
+                uint32_t pos = std::uniform_int_distribution<uint32_t>(pos_lo, pos_hi)(rng);
+                Node* child_node = innerNode->children[pos];
+                child_node->lock_read();
+                node->unlock_read();
+                node = child_node;
+            }
+
+            auto* leafNode = static_cast<LeafNode*>(node);
+            uint32_t first = leafNode->lower_bound(lo).first;
+            uint32_t last = leaf_upper_bound(leafNode, hi);
+            if (first < last) {
+                if (parted) {
+                    keep *= static_cast<double>(last - first) / (kCapacity + kLeafOverflow);
+                }
+                uint32_t pos = std::uniform_int_distribution<uint32_t>(first, last - 1)(rng);
+                if (keep >= 1 || coin(rng) < keep) {
+                    entries.emplace_back(leafNode->keys[pos], leafNode->values[pos]);
+                }
+            }
+            node->unlock_read();
+        }
+        return entries;
+    }
+
+    // Lookup that returns Busy instead of waiting for a latch
+    OpStatus try_get(const KeyT &key, ValueT &value) {
+        LatencyScope latency_scope(this, BtreeOp::Get);
+        return lookup(key, value, TryAcquire{});
+    }
+
+    // Insert that returns Busy instead of waiting for a latch
+    OpStatus try_put(const KeyT &key, const ValueT &value) {
+        LatencyScope latency_scope(this, BtreeOp::Put);
+        return upsert(key, value, TryAcquire{});
+    }
+
+    // Lookup that returns Busy if it cannot get its latches before the deadline
+    OpStatus get_until(const KeyT &key, ValueT &value, std::chrono::steady_clock::time_point deadline) {
+        LatencyScope latency_scope(this, BtreeOp::Get);
+        return lookup(key, value, DeadlineAcquire{deadline});
+    }
+
+    // Insert that returns Busy if it cannot get its latches before the deadline
+    OpStatus put_until(const KeyT &key, const ValueT &value, std::chrono::steady_clock::time_point deadline) {
+        LatencyScope latency_scope(this, BtreeOp::Put);
+        return upsert(key, value, DeadlineAcquire{deadline});
+    }
+
+    // Let full leaves take up to kLeafOverflow extra entries and split them on a
+    // background thread instead of in put. May run concurrently with
+    // disable_deferred_splits and other operations, not with the destructor.
+    void enable_deferred_splits() {
+        std::lock_guard<std::mutex> control(split_control_mutex);
+        std::lock_guard<std::mutex> lock(split_mutex);
+        if (!split_thread.joinable()) {
+            split_stop = false;
+            split_thread = std::thread([this] { split_worker(); });
+        }
+        deferred_splits.store(true, std::memory_order_relaxed);
+    }
+
+    // Go back to splitting in put, after the pending splits are done. May run
+    // concurrently with enable_deferred_splits, not with the destructor.
+    void disable_deferred_splits() {
+        std::lock_guard<std::mutex> control(split_control_mutex);
+        deferred_splits.store(false, std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> lock(split_mutex);
+            split_stop = true;
+        }
+        split_cv.notify_all();
+        if (split_thread.joinable()) {
+            split_thread.join();
+        }
+    }
+
+    // Block until all queued splits have been done
+    void wait_for_splits() {
+        std::unique_lock<std::mutex> lock(split_mutex);
+        split_done_cv.wait(lock, [this] { return splits_pending == 0; });
+    }
+private:
+    template<typename, typename, typename, std::size_t, typename...>
+    friend struct IndexedTable;
+
+    // Of (key, payload) pairs sorted by key, keep the last pair of every run of
+    // equal keys, in place
+    template<typename PairT>
+    static void keep_last_of_equal_keys(std::vector<PairT> &pairs) {
+        const ComparatorT comparator{};
+        std::size_t kept = 0;
+        for (std::size_t i = 0; i < pairs.size(); i++) {
+            if (i + 1 < pairs.size() && !comparator(pairs[i].first, pairs[i + 1].first)) {
+                continue;
+            }
+            if (kept != i) {
+                pairs[kept] = std::move(pairs[i]);
+            }
+            kept++;
+        }
+        pairs.resize(kept);
+    }
+
+    // Latch acquisition policies of the descents. Blocking never fails, so its
+    // failure branches compile away.
+    struct BlockingAcquire {
+        bool global(Btree* tree) const { tree->lock_global(); return true; }
+        void release_global(Btree* tree) const { tree->global_mutex.unlock(); }
+        bool shared(const Node* node) const { node->lock_read(); return true; }
+        bool exclusive(Node* node) const { node->lock_write(); return true; }
+        bool range_unlocked(Btree* tree, const KeyT &key) const { tree->range_locks.wait_unlocked(key); return true; }
+    };
+
+    struct TryAcquire {
+        bool global(Btree* tree) const { return tree->global_mutex.try_lock(); }
+        void release_global(Btree* tree) const { tree->global_mutex.unlock(); }
+        bool shared(const Node* node) const { return node->mtx.try_lock_shared(); }
+        bool exclusive(Node* node) const { return node->mtx.try_lock(); }
+        bool range_unlocked(Btree*, const KeyT &) const { return false; }
+    };
+
+    // Retries a try-latch with yields until the deadline passes
+    struct DeadlineAcquire {
+        std::chrono::steady_clock::time_point deadline;
+
+        template<typename TryFn>
+        bool retry(TryFn &&try_latch) const {
+            while (!try_latch()) {
+                if (std::chrono::steady_clock::now() >= deadline) {
+                    return false;
+                }
+                std::this_thread::yield();
+            }
+            return true;
+        }
+
+        bool global(Btree* tree) const { return retry([tree] { return tree->global_mutex.try_lock(); }); }
+        void release_global(Btree* tree) const { tree->global_mutex.unlock(); }
+        bool shared(const Node* node) const { return retry([node] { return node->mtx.try_lock_shared(); }); }
+        bool exclusive(Node* node) const { return retry([node] { return node->mtx.try_lock(); }); }
+        bool range_unlocked(Btree* tree, const KeyT &key) const {
+            return tree->range_locks.wait_unlocked_until(key, deadline);
+        }
+    };
+
+    template<typename AcquireT>
+    OpStatus lookup(const KeyT &key, ValueT &value, AcquireT acquire) {
+        if (!root.load(std::memory_order_acquire)) {
+            return OpStatus::NotFound;
+        }
+        LeafNode* leafNode = latch_leaf_for_read(key, acquire);
+        if (!leafNode) {
+            return OpStatus::Busy;
+        }
+
+        auto [pos, found] = leafNode->lower_bound(key);
+        if (found) {
+            value = leafNode->values[pos];
+        }
+        leafNode->unlock_read();
+
+        return found ? OpStatus::Ok : OpStatus::NotFound;
+    }
+
+    template<typename AcquireT>
+    OpStatus upsert(const KeyT &key, const ValueT &value, AcquireT acquire) {
+        bool deferred = deferred_splits.load(std::memory_order_relaxed);
+
+        LeafNode* leafNode = latch_leaf_for_update(key, deferred ? kCapacity + kLeafOverflow : kCapacity, acquire);
+        if (!leafNode) {
+            return OpStatus::Busy;
+        }
+        leafNode->insert(key, value);
+
+        // The leaf spilled into its overflow slots, let the background thread split it
+        if (deferred && kCapacity <= leafNode->children_count && !leafNode->split_queued) {
+            leafNode->split_queued = true;
+            leafNode->unlock_write();
+            finish_write();
+            queue_split(key);
+            return OpStatus::Ok;
+        }
+        leafNode->unlock_write();
+        finish_write();
+        return OpStatus::Ok;
+    }
+
+    // Latch the root for reading. A writer can replace the root between loading and
+    // latching it, so the root is loaded again once latched and the latch retaken
+    // until both agree. Returns nullptr if the tree is empty or a latch could not be
+    // acquired.
+    template<typename AcquireT>
+    Node* latch_root_for_read(AcquireT acquire) {
+        Node* node = root.load(std::memory_order_acquire);
+        while (node) {
+            if (!acquire.shared(node)) {
+                return nullptr;
+            }
+            Node* current = root.load(std::memory_order_acquire);
+            if (current == node) {
+                return node;
+            }
+            trace_root_restart(node->level);
+            if constexpr (kLatencyStats) {
+                latency.record_restart();
+            }
+            node->unlock_read();
+            node = current;
+        }
+        return nullptr;
+    }
+
+    // Descend along the first children with lock coupling. Returns the leftmost leaf
+    // latched for reading, or nullptr if the tree is empty.
+    LeafNode* latch_leftmost_leaf() {
+        Node* current_node = latch_root_for_read(BlockingAcquire{});
+        if (!current_node) {
+            return nullptr;
+        }
+        while (!current_node->is_leaf()) {
+            Node* child_node = static_cast<InnerNode*>(current_node)->children[0];
+            child_node->lock_read();
+            current_node->unlock_read();
+            current_node = child_node;
+        }
+        return static_cast<LeafNode*>(current_node);
+    }
+
+    // Descend to the leaf for a key with lock coupling. Returns the leaf latched for
+    // reading, or nullptr if the tree is empty or a latch could not be acquired.
+    template<typename AcquireT = BlockingAcquire>
+    LeafNode* latch_leaf_for_read(const KeyT &key, AcquireT acquire = {}) {
+        Node* current_node = latch_root_for_read(acquire);
+        if (!current_node) {
+            return nullptr;
+        }
+
+        // Lock coupling until reaching a leaf
+        while (!current_node->is_leaf()) {
+            InnerNode* current_inner_node = static_cast<InnerNode*>(current_node);
+            uint32_t pos = current_inner_node->lower_bound(key).first;
+            Node* child_node = current_inner_node->children[pos];
+
+            if (!acquire.shared(child_node)) {
+                current_node->unlock_read();
+                return nullptr;
+            }
+            current_node->unlock_read();
+
+            current_node = child_node;
+        }
+        return static_cast<LeafNode*>(current_node);
+    }
+
+    // Descend to the leaf for a key with lock coupling, splitting full nodes on the way
+    // down. The leaf is split when it holds leaf_limit entries or more. Returns the
+    // leaf latched for writing, everything else unlatched; the caller calls
+    // finish_write after releasing it. Every node on the path is stamped with a new
+    // version. Returns nullptr if a latch could not be acquired, splits done up to
+    // that point are kept.
+    template<typename AcquireT = BlockingAcquire>
+    LeafNode* latch_leaf_for_write(const KeyT &key, std::size_t leaf_limit, AcquireT acquire = {}) {
+        return static_cast<LeafNode*>(descend_for_write(key, leaf_limit, false, nullptr, acquire));
+    }
+
+    // Upper bound of the keys routed to a node, unbounded on the right edge
+    struct Fence {
+        KeyT key{};
+        bool bounded = false;
+    };
+
+    // Descend with lock coupling to the leaf routed the keys just above *after, or to
+    // the leftmost leaf if after is null. Returns it latched for reading and sets
+    // fence to its upper bound, or returns nullptr if the tree is empty.
+    LeafNode* latch_leaf_above(const KeyT* after, Fence &fence) {
+        const ComparatorT comparator{};
+        Node* current_node = latch_root_for_read(BlockingAcquire{});
+        if (!current_node) {
+            return nullptr;
+        }
+        fence = Fence{};
+        while (!current_node->is_leaf()) {
+            InnerNode* innerNode = static_cast<InnerNode*>(current_node);
+            const KeyT* separators = innerNode->keys;
+            const KeyT* separators_end = separators + innerNode->children_count - 1;
+            auto pos = static_cast<uint32_t>(
+                after ? std::upper_bound(separators, separators_end, *after, comparator) - separators : 0);
+            if (pos + 1u < innerNode->children_count) {
+                set_fence(&fence, innerNode->keys[pos]);
+            }
+            Node* child_node = innerNode->children[pos];
+            child_node->lock_read();
+            innerNode->unlock_read();
+            current_node = child_node;
+        }
+        return static_cast<LeafNode*>(current_node);
+    }
+
+    // latch_leaf_for_write for a change to key, which also waits for range locks
+    // holding key. Checked while counted as a running writer: a range lock taken
+    // later waits for this writer, one taken earlier is seen here.
+    template<typename AcquireT>
+    LeafNode* latch_leaf_for_update(const KeyT &key, std::size_t leaf_limit, AcquireT acquire, Fence* fence = nullptr) {
+        LeafNode* leafNode = static_cast<LeafNode*>(descend_for_write(key, leaf_limit, false, fence, acquire));
+        while (leafNode && !range_locks.empty() && range_locks.conflicts(key, key, nullptr)) {
+            leafNode->unlock_write();
+            finish_write();
+            if (!acquire.range_unlocked(this, key)) {
+                return nullptr;
+            }
+            if (fence) {
+                *fence = Fence{};
+            }
+            leafNode = static_cast<LeafNode*>(descend_for_write(key, leaf_limit, false, fence, acquire));
+        }
+        return leafNode;
+    }
+
+    // Fast path of append. Only the leaf is stamped: its ancestors carry at least
+    // the hint's version, which stays valid while it is newer than any version
+    // snapshots and checkpoints compare against. Nodes added above the leaf since
+    // carry newer versions.
+    bool append_to_hint(const KeyT &key, const ValueT &value, AppendHint &hint) {
+        lock_global();
+        if (hint.epoch != structure_epoch || hint.version <= frozen_version) {
+            global_mutex.unlock();
+            return false;
+        }
+        uint64_t version = ++version_clock;
+        active_writers.fetch_add(1, std::memory_order_relaxed);
+        global_mutex.unlock();
+
+        // The leaf still holds (hint.last, fence] if it was not split since
+        const ComparatorT comparator{};
+        LeafNode* leafNode = hint.leaf;
+        leafNode->lock_write();
+        bool fits = leafNode->splits == hint.splits && leafNode->children_count < kCapacity &&
+                    comparator(hint.last, key) && (!hint.bounded || !comparator(hint.fence, key)) &&
+                    range_locks.empty();
+        if (fits) {
+            leafNode->version = version;
+            leafNode->insert(key, value);
+            hint.last = key;
+        }
+        leafNode->unlock_write();
+        finish_write();
+        return fits;
+    }
+
+    // Same descent as latch_leaf_for_write, but stops at the parent of the leaf for
+    // key and returns it latched for writing. Fills in the fence of the parent.
+    // Returns nullptr, with nothing latched, if the root is not an inner node.
+    InnerNode* latch_parent_for_write(const KeyT &key, Fence &fence) {
+        return static_cast<InnerNode*>(descend_for_write(key, kCapacity, true, &fence, BlockingAcquire{}));
+    }
+
+    template<typename AcquireT>
+    Node* descend_for_write(const KeyT &key, std::size_t leaf_limit, bool stop_at_parent, Fence* fence,
+                            AcquireT acquire) {
+        // Global lock for cases where the root is updated
+        if (!acquire.global(this)) {
+            return nullptr;
+        }
+
+        Node* current_node = root.load(std::memory_order_relaxed);
+        if (stop_at_parent && (!current_node || current_node->is_leaf())) {
+            acquire.release_global(this);
+            return nullptr;
+        }
+        uint64_t version = ++version_clock;
+        active_writers.fetch_add(1, std::memory_order_relaxed);
+
+        // Empty tree
+        if (!current_node) {
+            auto* leaf = new LeafNode();
+            leaf->version = version;
+            leaf->lock_write();
+            root.store(leaf, std::memory_order_release);
+            acquire.release_global(this);
+
+            return leaf;
+        }
+
+        const ComparatorT comparator{};
+        if (!acquire.exclusive(current_node)) {
+            acquire.release_global(this);
+            finish_write();
+            return nullptr;
+        }
+        current_node->version = version;
+
+        if (current_node->is_leaf()) {
+            LeafNode* leafNode = static_cast<LeafNode*>(current_node);
+            // Need to split the node
+            if (leaf_limit <= leafNode->children_count) {
+                SplitScope split_scope(this, leafNode->level);
+                LeafNode* right_neighbor_node;
+                InnerNode* new_root;
+                right_neighbor_node = new LeafNode();
+                new_root = new InnerNode();
+                right_neighbor_node->version = version;
+                new_root->version = version;
+
+                right_neighbor_node->lock_write();
+
+                KeyT separator_key = leafNode->split(right_neighbor_node);
+
+                new_root->lock_write();
+
+                // Create a new root
+                InnerNode* parent_node = new_root;
+
+                parent_node->level = 1;
+                parent_node->children_count = 1;
+                parent_node->children[0] = leafNode;
+                parent_node->insert_split(separator_key, right_neighbor_node);
+                parent_node->unlock_write();
+
+                root.store(new_root, std::memory_order_release);
+                trace_root_grow(new_root->level);
+                acquire.release_global(this);
+
+                if (comparator(separator_key, key)) {
+                    leafNode->unlock_write();
+                    return right_neighbor_node;
+                }
+                right_neighbor_node->unlock_write();
+                set_fence(fence, separator_key);
+                return leafNode;
+            }
+            acquire.release_global(this);
+            return leafNode;
+        }
+
+        InnerNode* innerNode = static_cast<InnerNode*>(current_node);
+        // Need to split the node
+        if (kCapacity <= innerNode->children_count) {
+            SplitScope split_scope(this, innerNode->level);
+            InnerNode* right_neighbor_node;
+            InnerNode* new_root;
+            right_neighbor_node = new InnerNode();
+            new_root = new InnerNode();
+            right_neighbor_node->version = version;
+            new_root->version = version;
+
+            right_neighbor_node->lock_write();
+            KeyT separator_key = innerNode->split(right_neighbor_node);
+            right_neighbor_node->level = innerNode->level;
+
+            // Create a new root, published before the old one is unlatched
+            InnerNode* parent_node = new_root;
+            parent_node->level = innerNode->level + 1;
+            parent_node->children_count = 1;
+            parent_node->children[0] = innerNode;
+            parent_node->insert_split(separator_key, right_neighbor_node);
+            root.store(new_root, std::memory_order_release);
+            trace_root_grow(new_root->level);
+
+            if (comparator(separator_key, key)) {
+                current_node->unlock_write();
+                current_node = right_neighbor_node;
+            }
+            else {
+                right_neighbor_node->unlock_write();
+                set_fence(fence, separator_key);
+            }
+        }
+        acquire.release_global(this);
+        // Lock coupling
+        while (true) {
+            innerNode = static_cast<InnerNode*>(current_node);
+            if (stop_at_parent && innerNode->level == 1) {
+                return innerNode;
+            }
+            uint32_t pos = innerNode->lower_bound(key).first;
+            if (pos + 1u < innerNode->children_count) {
+                set_fence(fence, innerNode->keys[pos]);
+            }
+            Node* child_node = innerNode->children[pos];
+            if (!acquire.exclusive(child_node)) {
+                current_node->unlock_write();
+                finish_write();
+                return nullptr;
+            }
+            child_node->version = version;
+
+            if (innerNode->level == 1) {
+                LeafNode* child_node_leaf = static_cast<LeafNode*>(child_node);
+                // Need to split the node
+                if (leaf_limit <= child_node_leaf->children_count) {
+                    SplitScope split_scope(this, child_node_leaf->level);
+                    LeafNode* right_neighbor_node;
+                    right_neighbor_node = new LeafNode();
+                    right_neighbor_node->version = version;
+                    right_neighbor_node->lock_write();
+                    KeyT separator_key = child_node_leaf->split(right_neighbor_node);
+
+                    if (comparator(separator_key, key)) {
+                        child_node_leaf->unlock_write();
+                        child_node_leaf = right_neighbor_node;
+                    }
+                    else {
+                        right_neighbor_node->unlock_write();
+                        set_fence(fence, separator_key);
+                    }
+                    innerNode->insert_split(separator_key, right_neighbor_node);
+                }
+
+                current_node->unlock_write();
+                return child_node_leaf;
+            }
+
+            InnerNode* child_node_inner = static_cast<InnerNode*>(child_node);
+            // Need to split the node
+            if (kCapacity <= child_node_inner->children_count) {
+                SplitScope split_scope(this, child_node_inner->level);
+                InnerNode* right_neighbor_node;
+                right_neighbor_node = new InnerNode();
+                right_neighbor_node->version = version;
+                right_neighbor_node->lock_write();
+                KeyT separator_key = child_node_inner->split(right_neighbor_node);
+                right_neighbor_node->level = child_node_inner->level;
+
+                if (comparator(separator_key, key)) {
+                    child_node_inner->unlock_write();
+                    child_node_inner = static_cast<InnerNode*>(right_neighbor_node);
+                }
+                else {
+                    right_neighbor_node->unlock_write();
+                    set_fence(fence, separator_key);
+                }
+                innerNode->insert_split(separator_key, right_neighbor_node);
+            }
+            current_node->unlock_write();
+            current_node = child_node_inner;
+        }
+    }
+
+    // Index after the last key <= key
+    static uint32_t leaf_upper_bound(LeafNode* leafNode, const KeyT &key) {
+        auto [pos, found] = leafNode->lower_bound(key);
+        return found ? pos + 1 : pos;
+    }
+
+    static void set_fence(Fence* fence, const KeyT &key) {
+        if (fence) {
+            fence->key = key;
+            fence->bounded = true;
+        }
+    }
+
+    // Hand a full leaf to split_thread. A writer that saw deferred splits enabled
+    // can get here after disable_deferred_splits stopped the thread; it splits the
+    // leaf itself then.
+    void queue_split(const KeyT &key) {
+        {
+            std::lock_guard<std::mutex> lock(split_mutex);
+            if (!split_stop) {
+                split_requests.push_back(key);
+                splits_pending++;
+                split_cv.notify_one();
+                return;
+            }
+        }
+        split_if_full(key);
+    }
+
+    // Split the leaf for key if it is still full. The leaf is checked under a read
+    // latch first, so a leaf that shrank since, or an emptied tree, is left alone.
+    void split_if_full(const KeyT &key) {
+        LeafNode* leafNode = latch_leaf_for_read(key);
+        if (!leafNode) {
+            return;
+        }
+        bool full = kCapacity <= leafNode->children_count;
+        leafNode->unlock_read();
+        if (full) {
+            // Descending with the eager limit splits the leaf if it is still full
+            latch_leaf_for_write(key, kCapacity)->unlock_write();
+            finish_write();
+        }
+    }
+
+    // Background thread splitting leaves that went into their overflow slots
+    void split_worker() {
+        std::unique_lock<std::mutex> lock(split_mutex);
+        while (true) {
+            split_cv.wait(lock, [this] { return split_stop || !split_requests.empty(); });
+            if (split_requests.empty()) {
+                return;
+            }
+            std::vector<KeyT> batch;
+            batch.swap(split_requests);
+            lock.unlock();
+
+            for (const KeyT &key : batch) {
+                split_if_full(key);
+            }
+
+            lock.lock();
+            splits_pending -= batch.size();
+            split_done_cv.notify_all();
+        }
+    }
+
+    // Commits run beside other writers. Every target leaf is first made to fit its
+    // new keys with ordinary write descents, splitting it if needed. Then the leaves
+    // of all reads and writes are latched in key order with try-latches; if one is
+    // taken, all are released and the commit starts over, so it never waits while
+    // holding a leaf. Reads are validated under those latches and the writes are
+    // applied together.
+    bool commit_transaction(Transaction &transaction) {
+        auto &writes = transaction.writes;
+        const ComparatorT comparator{};
+        std::stable_sort(writes.begin(), writes.end(), [&comparator](const auto &a, const auto &b) {
+            return comparator(a.first, b.first);
+        });
+        keep_last_of_equal_keys(writes);
+        if (writes.size() > kMaxTransactionWrites) {
+            return false;
+        }
+
+        std::vector<KeyT> keys;
+        for (const auto &write : writes) {
+            keys.push_back(write.first);
+        }
+        for (const auto &read : transaction.reads) {
+            keys.push_back(read.key);
+        }
+        std::sort(keys.begin(), keys.end(), comparator);
+
+        uint64_t stamp = make_room(writes);
+        std::vector<LeafNode*> latched;
+        std::vector<Fence> fences;
+        // Latched leaf routed key
+        auto leaf_of = [&](const KeyT &key) {
+            std::size_t i = 0;
+            while (fences[i].bounded && comparator(fences[i].key, key)) {
+                i++;
+            }
+            return latched[i];
+        };
+        auto release = [&] {
+            for (LeafNode* leafNode : latched) {
+                leafNode->unlock_write();
+            }
+            latched.clear();
+            fences.clear();
+            finish_write();
+        };
+
+        while (true) {
+            // The paths to the leaves carry versions from make_room at least, which
+            // must be newer than any version snapshots and checkpoints compare
+            // against, see append_to_hint
+            lock_global();
+            if (!writes.empty() && stamp <= frozen_version) {
+                global_mutex.unlock();
+                stamp = make_room(writes);
+                continue;
+            }
+            uint64_t version = ++version_clock;
+            active_writers.fetch_add(1, std::memory_order_relaxed);
+            bool empty = !root.load(std::memory_order_relaxed);
+            global_mutex.unlock();
+            if (empty) {
+                // Only without writes, make_room adds a root otherwise
+                finish_write();
+                return std::none_of(transaction.reads.begin(), transaction.reads.end(),
+                                    [](const auto &read) { return read.found_leaf; });
+            }
+
+            bool busy = false;
+            for (const KeyT &key : keys) {
+                if (!latched.empty() && (!fences.back().bounded || !comparator(fences.back().key, key))) {
+                    continue;
+                }
+                Fence fence;
+                LeafNode* leafNode = try_latch_leaf_for_commit(key, fence);
+                if (!leafNode) {
+                    busy = true;
+                    break;
+                }
+                latched.push_back(leafNode);
+                fences.push_back(fence);
+            }
+            if (busy) {
+                release();
+                std::this_thread::yield();
+                continue;
+            }
+
+            for (const auto &read : transaction.reads) {
+                if (!read.found_leaf || leaf_of(read.key)->version != read.version) {
+                    release();
+                    return false;
+                }
+            }
+            // Range locks are checked while counted as a running writer, see
+            // latch_leaf_for_update
+            if (!range_locks.empty()) {
+                for (const auto &write : writes) {
+                    if (range_locks.conflicts(write.first, write.first, &transaction)) {
+                        release();
+                        return false;
+                    }
+                }
+            }
+
+            // Writers may have filled a leaf since make_room
+            bool fits = true;
+            std::size_t i = 0;
+            for (std::size_t l = 0; l < latched.size() && fits; l++) {
+                std::size_t added = 0;
+                for (; i < writes.size() && (!fences[l].bounded || !comparator(fences[l].key, writes[i].first)); i++) {
+                    added += latched[l]->lower_bound(writes[i].first).second ? 0 : 1;
+                }
+                fits = latched[l]->children_count + added <= kCapacity;
+            }
+            if (!fits) {
+                release();
+                stamp = make_room(writes);
+                continue;
+            }
+
+            for (const auto &[key, value] : writes) {
+                LeafNode* leafNode = leaf_of(key);
+                leafNode->version = version;
+                leafNode->insert(key, value);
+            }
+            release();
+            return true;
+        }
+    }
+
+    // Split the target leaves of sorted writes until each fits the new keys routed
+    // to it. The path down to the parent is stamped as by any write descent, but a
+    // leaf is only read, so that its version still validates the transaction's
+    // reads unless it has to be split. Returns a version that every node stamped
+    // here carries at least, or 0 without writes.
+    uint64_t make_room(const std::vector<std::pair<KeyT, ValueT>> &writes) {
+        const ComparatorT comparator{};
+        uint64_t stamp = 0;
+        for (std::size_t i = 0; i < writes.size();) {
+            Fence fence;
+            LeafNode* leafNode;
+            if (InnerNode* parent = latch_parent_for_write(writes[i].first, fence)) {
+                stamp = stamp ? stamp : parent->version;
+                uint32_t pos = parent->lower_bound(writes[i].first).first;
+                if (pos + 1u < parent->children_count) {
+                    set_fence(&fence, parent->keys[pos]);
+                }
+                leafNode = static_cast<LeafNode*>(parent->children[pos]);
+                leafNode->lock_read();
+                parent->unlock_write();
+                finish_write();
+            }
+            else {
+                // The root is a leaf, or the tree is empty and a put adds the root
+                lock_global();
+                Node* root_node = root.load(std::memory_order_relaxed);
+                if (!root_node || !root_node->is_leaf()) {
+                    global_mutex.unlock();
+                    if (!root_node) {
+                        latch_leaf_for_write(writes[i].first, kCapacity)->unlock_write();
+                        finish_write();
+                    }
+                    continue;
+                }
+                stamp = stamp ? stamp : version_clock + 1;
+                leafNode = static_cast<LeafNode*>(root_node);
+                leafNode->lock_read();
+                global_mutex.unlock();
+            }
+
+            std::size_t end = i;
+            std::size_t added = 0;
+            for (; end < writes.size() && (!fence.bounded || !comparator(fence.key, writes[end].first)); end++) {
+                added += leafNode->lower_bound(writes[end].first).second ? 0 : 1;
+            }
+            bool fits = leafNode->children_count + added <= kCapacity;
+            std::size_t count = leafNode->children_count;
+            leafNode->unlock_read();
+            if (fits) {
+                i = end;
+                continue;
+            }
+            latch_leaf_for_write(writes[i].first, count)->unlock_write();
+            finish_write();
+        }
+        return stamp;
+    }
+
+    // Descend with try-latches, shared on inner nodes and exclusive on the leaf, and
+    // return the leaf for key with its fence. Stamps nothing. Returns nullptr, with
+    // nothing latched, if a latch is taken or the root was replaced meanwhile.
+    LeafNode* try_latch_leaf_for_commit(const KeyT &key, Fence &fence) {
+        auto try_latch = [](Node* node) {
+            return node->is_leaf() ? TryAcquire{}.exclusive(node) : TryAcquire{}.shared(node);
+        };
+        auto unlatch = [](Node* node) {
+            if (node->is_leaf()) {
+                node->unlock_write();
+            }
+            else {
+                node->unlock_read();
+            }
+        };
+        Node* current_node = root.load(std::memory_order_acquire);
+        if (!try_latch(current_node)) {
+            return nullptr;
+        }
+        if (root.load(std::memory_order_acquire) != current_node) {
+            unlatch(current_node);
+            return nullptr;
+        }
+        while (!current_node->is_leaf()) {
+            InnerNode* innerNode = static_cast<InnerNode*>(current_node);
+            uint32_t pos = innerNode->lower_bound(key).first;
+            if (pos + 1u < innerNode->children_count) {
+                set_fence(&fence, innerNode->keys[pos]);
+            }
+            Node* child_node = innerNode->children[pos];
+            bool latched = try_latch(child_node);
+            innerNode->unlock_read();
+            if (!latched) {
+                return nullptr;
+            }
+            current_node = child_node;
+        }
+        return static_cast<LeafNode*>(current_node);
+    }
+
+    // Range locks are taken with no writer running, see upsert
+    bool lock_range(const KeyT &lo, const KeyT &hi, const void* owner) {
+        lock_global_drained();
+        bool locked = range_locks.try_lock(lo, hi, owner);
+        global_mutex.unlock();
+        return locked;
+    }
+
+    // Take the tree-wide lock, which keeps new writers out, and wait for the
+    // running ones to finish
+    void lock_global_drained() {
+        lock_global();
+        while (active_writers.load(std::memory_order_acquire) != 0) {
+            std::this_thread::yield();
+        }
+    }
+
+    void finish_write() {
+        active_writers.fetch_sub(1, std::memory_order_release);
+    }
+
+    void lock_global() {
+#if BTREE_TRACING
+        if (!global_mutex.try_lock()) {
+            uint64_t start = now_ns();
+            global_mutex.lock();
+            global_tracer().latch_wait(Tracer::kGlobalLevel, start);
+        }
+#else
+        global_mutex.lock();
+#endif
+    }
+
+    static void trace_root_grow([[maybe_unused]] uint16_t level) {
+#if BTREE_TRACING
+        global_tracer().record(TraceEvent::RootGrow, level, now_ns(), 0);
+#endif
+    }
+
+    static void trace_root_restart([[maybe_unused]] uint16_t level) {
+#if BTREE_TRACING
+        global_tracer().record(TraceEvent::RootRestart, level, now_ns(), 0);
+#endif
+    }
+
+    // Split a subtree into the keys < key and the keys >= key. Either half is
+    // nullptr when it is empty; both halves keep the height of the subtree.
+    static std::pair<Node*, Node*> cut(Node* node, const KeyT &key) {
+        if (node->is_leaf()) {
+            LeafNode* leafNode = static_cast<LeafNode*>(node);
+            uint32_t index = leafNode->lower_bound(key).first;
+            if (index == 0) {
+                return {nullptr, leafNode};
+            }
+            if (index == leafNode->children_count) {
+                return {leafNode, nullptr};
+            }
+            auto* right = new LeafNode();
+            std::copy(leafNode->keys + index, leafNode->keys + leafNode->children_count, right->keys);
+            std::copy(leafNode->values + index, leafNode->values + leafNode->children_count, right->values);
+            right->children_count = leafNode->children_count - index;
+            leafNode->children_count = index;
+            right->next = leafNode->next;
+            leafNode->next = nullptr;
+            return {leafNode, right};
+        }
+
+        InnerNode* innerNode = static_cast<InnerNode*>(node);
+        uint32_t pos = innerNode->lower_bound(key).first;
+        auto [left_child, right_child] = cut(innerNode->children[pos], key);
+
+        // Children after pos move to a new node, with the separators between them
+        auto* right = new InnerNode();
+        right->level = innerNode->level;
+        if (right_child) {
+            right->children[right->children_count++] = right_child;
+        }
+        for (uint32_t i = pos + 1; i < innerNode->children_count; i++) {
+            if (right->children_count > 0) {
+                right->keys[right->children_count - 1] = innerNode->keys[i - 1];
+            }
+            right->children[right->children_count++] = innerNode->children[i];
+        }
+
+        // Children before pos stay, keys[pos - 1] still separates them from left_child
+        innerNode->children_count = pos;
+        if (left_child) {
+            innerNode->children[innerNode->children_count++] = left_child;
+        }
+
+        Node* left = innerNode;
+        if (innerNode->children_count == 0) {
+            delete innerNode;
+            left = nullptr;
+        }
+        if (right->children_count == 0) {
+            delete right;
+            return {left, nullptr};
+        }
+        return {left, right};
+    }
+
+    // Drop inner roots with a single child
+    static Node* collapse_root(Node* node) {
+        while (node && !node->is_leaf() && node->children_count == 1) {
+            Node* child = static_cast<InnerNode*>(node)->children[0];
+            delete node;
+            node = child;
+        }
+        return node;
+    }
+
+    static LeafNode* rightmost_leaf(Node* node) {
+        while (node && !node->is_leaf()) {
+            auto* innerNode = static_cast<InnerNode*>(node);
+            node = innerNode->children[innerNode->children_count - 1];
+        }
+        return static_cast<LeafNode*>(node);
+    }
+
+    // Drop empty leaves left by erase from the right edge, so that the last leaf
+    // holds the largest key. Stops at a root that is a leaf.
+    void trim_empty_right_edge() {
+        while (true) {
+            Node* top = collapse_root(root);
+            root = top;
+            if (!top || top->is_leaf() || rightmost_leaf(top)->children_count > 0) {
+                return;
+            }
+            // Below the lowest node with several children the right edge is a chain
+            // of single children ending in the empty leaf
+            InnerNode* parent = nullptr;
+            Node* node = root;
+            while (!node->is_leaf()) {
+                auto* innerNode = static_cast<InnerNode*>(node);
+                if (innerNode->children_count > 1) {
+                    parent = innerNode;
+                }
+                node = innerNode->children[innerNode->children_count - 1];
+            }
+            delete_subtree(parent->children[--parent->children_count]);
+            rightmost_leaf(root)->next = nullptr;
+        }
+    }
+
+    // Largest key of a subtree, nullptr if all its leaves are empty. Visits the
+    // empty leaves on the right edge, as trim_empty_right_edge does.
+    static const KeyT* max_key(const Node* node) {
+        if (node->is_leaf()) {
+            auto* leafNode = static_cast<const LeafNode*>(node);
+            return leafNode->children_count > 0 ? &leafNode->keys[leafNode->children_count - 1] : nullptr;
+        }
+        auto* innerNode = static_cast<const InnerNode*>(node);
+        for (uint16_t i = innerNode->children_count; i-- > 0;) {
+            if (const KeyT* key = max_key(innerNode->children[i])) {
+                return key;
+            }
+        }
+        return nullptr;
+    }
+
+    static LeafNode* leftmost_leaf(Node* node) {
+        while (node && !node->is_leaf()) {
+            node = static_cast<InnerNode*>(node)->children[0];
+        }
+        return static_cast<LeafNode*>(node);
+    }
+
+    static InnerNode* make_root(Node* left, const KeyT &separator, Node* right) {
+        auto* new_root = new InnerNode();
+        new_root->level = left->level + 1;
+        new_root->children_count = 2;
+        new_root->children[0] = left;
+        new_root->children[1] = right;
+        new_root->keys[0] = separator;
+        return new_root;
+    }
+
+    // Hang subtree, which is lower than node, off the right spine of node. Returns a
+    // new right sibling of node with its separator if node had no room.
+    static std::pair<KeyT, Node*> attach_rightmost(InnerNode* node, const KeyT &separator, Node* subtree) {
+        Node* child = subtree;
+        KeyT child_separator = separator;
+        if (node->level > subtree->level + 1) {
+            auto* last = static_cast<InnerNode*>(node->children[node->children_count - 1]);
+            std::tie(child_separator, child) = attach_rightmost(last, separator, subtree);
+            if (!child) {
+                return {separator, nullptr};
+            }
+        }
+        if (node->children_count < kCapacity) {
+            node->keys[node->children_count - 1] = child_separator;
+            node->children[node->children_count++] = child;
+            return {separator, nullptr};
+        }
+        auto* sibling = new InnerNode();
+        sibling->level = node->level;
+        sibling->children_count = 1;
+        sibling->children[0] = child;
+        return {child_separator, sibling};
+    }
+
+    // Hang subtree, which is lower than node, off the left spine of node. Returns a
+    // new left sibling of node if node had no room; separator stays the separator.
+    static Node* attach_leftmost(InnerNode* node, const KeyT &separator, Node* subtree) {
+        Node* child = subtree;
+        if (node->level > subtree->level + 1) {
+            child = attach_leftmost(static_cast<InnerNode*>(node->children[0]), separator, subtree);
+            if (!child) {
+                return nullptr;
+            }
+        }
+        if (node->children_count < kCapacity) {
+            for (uint32_t i = node->children_count; i > 0; i--) {
+                node->children[i] = node->children[i - 1];
+                if (i < node->children_count) {
+                    node->keys[i] = node->keys[i - 1];
+                }
+            }
+            node->children[0] = child;
+            node->keys[0] = separator;
+            node->children_count++;
+            return nullptr;
+        }
+        auto* sibling = new InnerNode();
+        sibling->level = node->level;
+        sibling->children_count = 1;
+        sibling->children[0] = child;
+        return sibling;
+    }
+
+    // Root of a tree without running writers
+    struct Frozen {
+        // Latched for reading, nullptr for an empty tree
+        Node* root;
+        uint64_t version;
+        uint64_t rebuilt_version;
+    };
+
+    // Wait for running writes to finish and hold off new ones until the returned root
+    // is unlatched; every write descent starts at the root
+    Frozen hold_writers() {
+        lock_global_drained();
+        frozen_version = version_clock;
+        Frozen frozen{root, version_clock, rebuilt_version};
+        if (frozen.root) {
+            frozen.root->lock_read();
+        }
+        global_mutex.unlock();
+        return frozen;
+    }
+
+    // Call fn(leaf, lo, hi) for the leaves of a subtree routed the keys in (lo, hi]
+    // that changed after version base, or for all of them if base is 0
+    template<typename Fn>
+    static void visit_changed(const Node* node, const KeyT* lo, const KeyT* hi, uint64_t base, Fn &fn) {
+        if (base != 0 && node->version <= base) {
+            return;
+        }
+        if (node->is_leaf()) {
+            fn(*static_cast<const LeafNode*>(node), lo, hi);
+            return;
+        }
+        auto* innerNode = static_cast<const InnerNode*>(node);
+        for (uint16_t i = 0; i < innerNode->children_count; i++) {
+            const KeyT* child_lo = i > 0 ? &innerNode->keys[i - 1] : lo;
+            const KeyT* child_hi = i + 1 < innerNode->children_count ? &innerNode->keys[i] : hi;
+            visit_changed(innerNode->children[i], child_lo, child_hi, base, fn);
+        }
+    }
+
+    // visit_changed for the leaves routed keys above *after, or all of them if after
+    // is null, until fn returns false. Returns false once fn has.
+    template<typename Fn>
+    static bool visit_changed_after(const Node* node, const KeyT* lo, const KeyT* hi, uint64_t base, const KeyT* after,
+                                    Fn &fn) {
+        if (base != 0 && node->version <= base) {
+            return true;
+        }
+        if (node->is_leaf()) {
+            return fn(*static_cast<const LeafNode*>(node), lo, hi);
+        }
+        const ComparatorT comparator{};
+        auto* innerNode = static_cast<const InnerNode*>(node);
+        for (uint16_t i = 0; i < innerNode->children_count; i++) {
+            const KeyT* child_lo = i > 0 ? &innerNode->keys[i - 1] : lo;
+            const KeyT* child_hi = i + 1 < innerNode->children_count ? &innerNode->keys[i] : hi;
+            if (after && child_hi && !comparator(*after, *child_hi)) {
+                continue;
+            }
+            if (!visit_changed_after(innerNode->children[i], child_lo, child_hi, base, after, fn)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    template<typename Fn>
+    static void visit_changed_parents(const Node* node, const KeyT* lo, const KeyT* hi, uint64_t base, Fn &fn) {
+        if (base != 0 && node->version <= base) {
+            return;
+        }
+        if (node->is_leaf()) {
+            fn(lo, hi, std::size_t{1}, static_cast<std::size_t>(node->children_count));
+            return;
+        }
+        auto* innerNode = static_cast<const InnerNode*>(node);
+        if (innerNode->level == 1) {
+            const Node* middle = innerNode->children[innerNode->children_count / 2];
+            fn(lo, hi, static_cast<std::size_t>(innerNode->children_count),
+               static_cast<std::size_t>(innerNode->children_count) * middle->children_count);
+            return;
+        }
+        for (uint16_t i = 0; i < innerNode->children_count; i++) {
+            const KeyT* child_lo = i > 0 ? &innerNode->keys[i - 1] : lo;
+            const KeyT* child_hi = i + 1 < innerNode->children_count ? &innerNode->keys[i] : hi;
+            visit_changed_parents(innerNode->children[i], child_lo, child_hi, base, fn);
+        }
+    }
+
+    // Merge the entries of a leaf of the newer tree with the entries of the older
+    // tree in (lo, hi]. A null leaf stands for no entries.
+    template<typename Fn, typename EqualT>
+    static void diff_leaf(const LeafNode* leafNode, const KeyT* lo, const KeyT* hi,
+                          Cursor &old_cursor, Fn &fn, EqualT &equal) {
+        const ComparatorT comparator{};
+        if (lo) {
+            old_cursor.seek(*lo);
+            if (old_cursor.valid() && !comparator(*lo, old_cursor.key())) {
+                old_cursor.next();
+            }
+        }
+        else {
+            old_cursor.fill(old_cursor.tree->latch_leftmost_leaf(), nullptr, true);
+        }
+
+        uint32_t count = leafNode ? leafNode->children_count : 0;
+        uint32_t i = 0;
+        while (true) {
+            bool has_old = old_cursor.valid() && (!hi || !comparator(*hi, old_cursor.key()));
+            bool has_new = i < count;
+            if (!has_old && !has_new) {
+                return;
+            }
+            if (has_old && (!has_new || comparator(old_cursor.key(), leafNode->keys[i]))) {
+                fn(old_cursor.key(), &old_cursor.value(), static_cast<const ValueT*>(nullptr));
+                old_cursor.next();
+            }
+            else if (!has_old || comparator(leafNode->keys[i], old_cursor.key())) {
+                fn(leafNode->keys[i], static_cast<const ValueT*>(nullptr), &leafNode->values[i]);
+                i++;
+            }
+            else {
+                if (!equal(old_cursor.value(), leafNode->values[i])) {
+                    fn(leafNode->keys[i], &old_cursor.value(), &leafNode->values[i]);
+                }
+                old_cursor.next();
+                i++;
+            }
+        }
+    }
+
+    static void store_entries(LeafNode* leafNode, const std::pair<KeyT, ValueT>* entries, std::size_t count) {
+        for (std::size_t i = 0; i < count; i++) {
+            leafNode->keys[i] = entries[i].first;
+            leafNode->values[i] = entries[i].second;
+        }
+        leafNode->children_count = static_cast<uint16_t>(count);
+    }
+
+    // Spread more than kCapacity entries evenly over a latched leaf and new leaves to
+    // its right, and add their separators to the latched parent at once
+    static void spread_entries(InnerNode* parent, uint32_t pos, LeafNode* leafNode,
+                               const std::vector<std::pair<KeyT, ValueT>> &entries) {
+        std::size_t m = entries.size();
+        std::size_t k = (m + kCapacity - 1) / kCapacity;
+
+        // Make room in the parent for k - 1 more children after pos
+        for (int i = static_cast<int>(parent->children_count) - 2; i >= static_cast<int>(pos); i--) {
+            parent->keys[i + k - 1] = parent->keys[i];
+        }
+        for (uint32_t i = parent->children_count - 1; i > pos; i--) {
+            parent->children[i + k - 1] = parent->children[i];
+        }
+        parent->children_count += static_cast<uint16_t>(k - 1);
+
+        // New leaves are complete before they are linked in under the leaf latch
+        LeafNode* previous = leafNode;
+        LeafNode* old_next = leafNode->next;
+        for (std::size_t j = 0; j < k; j++) {
+            std::size_t begin = m * j / k;
+            std::size_t end = m * (j + 1) / k;
+            LeafNode* target = j == 0 ? leafNode : new LeafNode();
+            target->version = parent->version;
+            store_entries(target, entries.data() + begin, end - begin);
+            if (j > 0) {
+                previous->next = target;
+                parent->children[pos + j] = target;
+            }
+            if (j + 1 < k) {
+                parent->keys[pos + j] = entries[end - 1].first;
+            }
+            previous = target;
+        }
+        previous->next = old_next;
+        leafNode->split_queued = false;
+        leafNode->splits++;
+    }
+
+    // Run fn(begin, end) over [0, count) split into contiguous chunks, one per
+    // thread. Small ranges run on the calling thread.
+    template<typename Fn>
+    static void parallel_for(std::size_t count, unsigned thread_count, Fn &&fn,
+                             std::vector<std::size_t>* chunk_starts = nullptr) {
+        constexpr std::size_t kMinChunk = 1024;
+        std::size_t chunks = std::min<std::size_t>(thread_count, (count + kMinChunk - 1) / kMinChunk);
+        if (chunks <= 1) {
+            if (chunk_starts) {
+                chunk_starts->assign(1, 0);
+            }
+            fn(std::size_t{0}, count);
+            return;
+        }
+
+        std::vector<std::thread> threads;
+        for (std::size_t c = 0; c < chunks; c++) {
+            std::size_t begin = count * c / chunks;
+            std::size_t end = count * (c + 1) / chunks;
+            if (chunk_starts) {
+                chunk_starts->push_back(begin);
+            }
+            threads.emplace_back([&fn, begin, end] { fn(begin, end); });
+        }
+        for (auto &thread : threads) {
+            thread.join();
+        }
+    }
+
+    // Stable sort by key: chunks are sorted in parallel, then merged pairwise in
+    // parallel rounds
+    static void parallel_stable_sort(std::vector<std::pair<KeyT, ValueT>> &entries, unsigned thread_count) {
+        const ComparatorT comparator{};
+        auto less = [&comparator](const std::pair<KeyT, ValueT> &a, const std::pair<KeyT, ValueT> &b) {
+            return comparator(a.first, b.first);
+        };
+
+        std::vector<std::size_t> bounds;
+        parallel_for(entries.size(), thread_count, [&](std::size_t begin, std::size_t end) {
+            std::stable_sort(entries.begin() + begin, entries.begin() + end, less);
+        }, &bounds);
+        bounds.push_back(entries.size());
+
+        while (bounds.size() > 2) {
+            std::vector<std::size_t> merged_bounds;
+            std::vector<std::thread> threads;
+            std::size_t i = 0;
+            for (; i + 2 < bounds.size(); i += 2) {
+                merged_bounds.push_back(bounds[i]);
+                threads.emplace_back([&entries, &less, begin = bounds[i], middle = bounds[i + 1], end = bounds[i + 2]] {
+                    std::inplace_merge(entries.begin() + begin, entries.begin() + middle, entries.begin() + end, less);
+                });
+            }
+            // An odd chunk at the end waits for the next round
+            for (; i < bounds.size(); i++) {
+                merged_bounds.push_back(bounds[i]);
+            }
+            for (auto &thread : threads) {
+                thread.join();
+            }
+            bounds.swap(merged_bounds);
+        }
+    }
+
     static void delete_subtree(Node* n) {
         if (!n) return;
         if (!n->is_leaf()) {
@@ -0,0 +1,348 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <optional>
+#include <ostream>
+#include <sstream>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "crc32c.h"
+
+// Incremental checkpoints of a Btree as an append-only stream of segments. The
+// first segment holds every leaf, later ones only the leaves changed since the
+// segment before. A page carries the key range routed to its leaf, so recovery
+// replaces that range and inner nodes need not be written. Keys and values are
+// written as raw bytes, see checkpoint_as_bytes.
+//
+// A segment is a run of page records closed by an end record:
+//   page: header, lo key, hi key, count keys, count values
+//   end:  header with the tree version, the log position and the page count
+// A segment without its end record was torn by a crash and is ignored. Every
+// record carries a CRC32C of its header and of its body; a mismatch anywhere else
+// fails the recovery.
+
+constexpr uint32_t kCheckpointMagic = 0x4B435442;
+
+// Whether values of T can be checkpointed as their raw bytes. Arithmetic and enum
+// types can. A trivially copyable type without pointers opts in by specializing
+// this as true. Types that point elsewhere, such as byte_array, are refused, since
+// recovery would bring back dangling addresses.
+template<typename T>
+struct checkpoint_as_bytes : std::bool_constant<std::is_arithmetic_v<T> || std::is_enum_v<T>> {};
+
+template<typename T>
+constexpr bool kCheckpointable = checkpoint_as_bytes<T>::value && std::is_trivially_copyable_v<T>;
+
+enum class CheckpointRecord : uint8_t { Page = 1, End = 2 };
+
+struct CheckpointHeader {
+    static constexpr uint8_t kHasLo = 1;
+    static constexpr uint8_t kHasHi = 2;
+    // End records only, the segment replaces everything before it
+    static constexpr uint8_t kComplete = 4;
+
+    uint32_t magic = kCheckpointMagic;
+    CheckpointRecord record;
+    uint8_t flags = 0;
+    uint16_t reserved = 0;
+    // CRC32C of the header with this field zero
+    uint32_t header_checksum = 0;
+    // CRC32C of the bytes after the header
+    uint32_t body_checksum = 0;
+    // Entries of a page, pages of a segment
+    uint64_t count = 0;
+    // Tree version covered by a segment
+    uint64_t version = 0;
+    // Caller's log position to replay from after loading a segment
+    uint64_t log_position = 0;
+};
+
+static_assert(sizeof(CheckpointHeader) == 40, "checkpoint headers are written as raw bytes");
+
+template<typename T>
+void checkpoint_write(std::ostream &out, const T* data, std::size_t count = 1) {
+    out.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(sizeof(T) * count));
+}
+
+inline uint32_t checkpoint_header_checksum(CheckpointHeader header) {
+    header.header_checksum = 0;
+    return crc32c(0, &header, sizeof(header));
+}
+
+template<typename KeyT, typename ValueT>
+void checkpoint_write_page(std::ostream &out, const KeyT* lo, const KeyT* hi, const KeyT* keys, const ValueT* values,
+                           std::size_t count) {
+    const KeyT none{};
+    lo = lo ? lo : &none;
+    hi = hi ? hi : &none;
+    CheckpointHeader header{};
+    header.record = CheckpointRecord::Page;
+    header.flags = (lo != &none ? CheckpointHeader::kHasLo : 0) | (hi != &none ? CheckpointHeader::kHasHi : 0);
+    header.count = count;
+    uint32_t crc = crc32c(0, lo, sizeof(KeyT));
+    crc = crc32c(crc, hi, sizeof(KeyT));
+    crc = crc32c(crc, keys, sizeof(KeyT) * count);
+    header.body_checksum = crc32c(crc, values, sizeof(ValueT) * count);
+    header.header_checksum = checkpoint_header_checksum(header);
+    checkpoint_write(out, &header);
+    checkpoint_write(out, lo);
+    checkpoint_write(out, hi);
+    checkpoint_write(out, keys, count);
+    checkpoint_write(out, values, count);
+}
+
+inline void checkpoint_write_end(std::ostream &out, bool complete, std::size_t pages, uint64_t version,
+                                 uint64_t log_position) {
+    CheckpointHeader end{};
+    end.record = CheckpointRecord::End;
+    end.flags = complete ? CheckpointHeader::kComplete : 0;
+    end.count = pages;
+    end.version = version;
+    end.log_position = log_position;
+    end.header_checksum = checkpoint_header_checksum(end);
+    checkpoint_write(out, &end);
+    out.flush();
+}
+
+template<typename T>
+bool checkpoint_read(std::istream &in, T* data, std::size_t count = 1) {
+    auto bytes = static_cast<std::streamsize>(sizeof(T) * count);
+    return in.read(reinterpret_cast<char*>(data), bytes).gcount() == bytes;
+}
+
+// Writes the checkpoint segments of one tree
+template<typename TreeT>
+struct Checkpointer {
+    using KeyT = typename TreeT::Key;
+    using ValueT = typename TreeT::Value;
+    static_assert(kCheckpointable<KeyT> && kCheckpointable<ValueT>,
+                  "checkpoints store keys and values as raw bytes, see checkpoint_as_bytes");
+
+    TreeT &tree;
+    // Tree version covered by the last segment, 0 before the first
+    uint64_t version = 0;
+    // Pages are copied into a buffer of about this size, which goes to the stream
+    // whenever it fills
+    std::size_t chunk_bytes;
+
+    // Constructor
+    explicit Checkpointer(TreeT &tree, std::size_t chunk_bytes = std::size_t{1} << 20)
+        : tree(tree), chunk_bytes(chunk_bytes) {}
+
+    // Append a segment with the leaves changed since the last one. Writers wait
+    // while a chunk of pages is copied, not while it goes to out, so chunks after
+    // the first may hold writes made during the call. As for FuzzyCheckpointer,
+    // log_position must be taken before the call. Readers do not wait. Must not run
+    // concurrently with split_at, concat or a bulk load. Returns the number of pages.
+    std::size_t write(std::ostream &out, uint64_t log_position = 0) {
+        std::size_t pages = 0;
+        std::ostringstream buffer;
+        std::optional<typename TreeT::ChangeSet> first;
+        // Upper bound of the last page written, empty before the first
+        std::optional<KeyT> after;
+        bool done = false;
+        while (!done) {
+            done = true;
+            auto changes = tree.visit_changed_leaves_after(version, after ? &*after : nullptr,
+                [&](const typename TreeT::LeafNode &leaf, const KeyT* lo, const KeyT* hi) {
+                    checkpoint_write_page(buffer, lo, hi, leaf.keys, leaf.values, leaf.children_count);
+                    pages++;
+                    if (hi && static_cast<std::size_t>(buffer.tellp()) >= chunk_bytes) {
+                        after = *hi;
+                        done = false;
+                        return false;
+                    }
+                    return true;
+                });
+            first = first ? first : changes;
+            out.write(buffer.view().data(), static_cast<std::streamsize>(buffer.view().size()));
+            buffer.str({});
+        }
+        checkpoint_write_end(out, first->complete, pages, first->version, log_position);
+        version = first->version;
+        return pages;
+    }
+};
+
+// Writes full checkpoint images while writers keep going. Leaves are copied one at
+// a time under a short read latch, so an image mixes the states the tree went
+// through during the walk; replaying the log from the position stored with it
+// brings it to a consistent state. Writes are paced to a byte rate.
+template<typename TreeT>
+struct FuzzyCheckpointer {
+    using KeyT = typename TreeT::Key;
+    using ValueT = typename TreeT::Value;
+    static_assert(kCheckpointable<KeyT> && kCheckpointable<ValueT>,
+                  "checkpoints store keys and values as raw bytes, see checkpoint_as_bytes");
+
+    TreeT &tree;
+    // Write rate limit, 0 for none
+    uint64_t bytes_per_second;
+
+    // Constructor
+    explicit FuzzyCheckpointer(TreeT &tree, uint64_t bytes_per_second = 0)
+        : tree(tree), bytes_per_second(bytes_per_second) {}
+
+    // Append a complete segment. log_position must be taken before the call, such
+    // that replaying the log from it repeats every put that may not have reached
+    // its leaf when the call started. Returns the number of pages.
+    std::size_t write(std::ostream &out, uint64_t log_position) {
+        auto start = std::chrono::steady_clock::now();
+        uint64_t written = 0;
+        std::size_t pages = 0;
+        std::vector<KeyT> keys;
+        std::vector<ValueT> values;
+
+        auto cursor = tree.cursor();
+        while (cursor.valid()) {
+            keys.clear();
+            values.clear();
+            for (std::size_t i = cursor.index; i < cursor.buffer.size(); i++) {
+                keys.push_back(cursor.buffer[i].first);
+                values.push_back(cursor.buffer[i].second);
+            }
+            checkpoint_write_page<KeyT, ValueT>(out, nullptr, nullptr, keys.data(), values.data(), keys.size());
+            pages++;
+            written += sizeof(CheckpointHeader) + 2 * sizeof(KeyT) + keys.size() * (sizeof(KeyT) + sizeof(ValueT));
+
+            // No latch is held while waiting
+            if (bytes_per_second) {
+                auto due = std::chrono::nanoseconds(
+                    static_cast<int64_t>(static_cast<double>(written) * 1e9 / static_cast<double>(bytes_per_second)));
+                std::this_thread::sleep_until(start + due);
+            }
+            cursor.next_leaf();
+        }
+        checkpoint_write_end(out, true, pages, 0, log_position);
+        return pages;
+    }
+};
+
+// Check the body checksums of pages on up to thread_count threads
+template<typename PageT>
+bool checkpoint_verify_pages(const std::vector<PageT> &pages, unsigned thread_count) {
+    // Below this many bytes per thread a thread costs more than it saves
+    constexpr std::size_t kMinBytes = std::size_t{1} << 20;
+    auto verify = [&pages](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; i++) {
+            if (crc32c(0, pages[i].body.data(), pages[i].body.size()) != pages[i].header.body_checksum) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    std::size_t bytes = 0;
+    for (const PageT &page : pages) {
+        bytes += page.body.size();
+    }
+    std::size_t chunks = std::min<std::size_t>({std::max(1u, thread_count), bytes / kMinBytes, pages.size()});
+    if (chunks <= 1) {
+        return verify(0, pages.size());
+    }
+    std::vector<std::thread> threads;
+    std::vector<char> ok(chunks);
+    for (std::size_t c = 0; c < chunks; c++) {
+        threads.emplace_back([&, c] { ok[c] = verify(pages.size() * c / chunks, pages.size() * (c + 1) / chunks); });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    return std::find(ok.begin(), ok.end(), 0) == ok.end();
+}
+
+// Rebuild an empty tree from a checkpoint stream and store the log position of the
+// last segment applied. The pages of each segment are verified on up to
+// thread_count threads. Returns false, leaving the tree unchanged, if the tree is
+// not empty, a checksum does not match or the stream has no complete segment.
+template<typename TreeT>
+bool recover_checkpoint(std::istream &in, TreeT &tree, uint64_t* log_position = nullptr,
+                        unsigned thread_count = std::thread::hardware_concurrency()) {
+    using KeyT = typename TreeT::Key;
+    using ValueT = typename TreeT::Value;
+    using Entries = std::vector<std::pair<KeyT, ValueT>>;
+
+    struct Page {
+        CheckpointHeader header;
+        std::vector<char> body;
+    };
+
+    const typename TreeT::Comparator comparator{};
+    Entries state;
+    std::vector<Page> pending;
+    bool found_complete = false;
+    uint64_t position = 0;
+
+    CheckpointHeader header;
+    while (checkpoint_read(in, &header)) {
+        if (header.magic != kCheckpointMagic || header.header_checksum != checkpoint_header_checksum(header)) {
+            return false;
+        }
+        if (header.record == CheckpointRecord::Page) {
+            Page page{header, std::vector<char>(2 * sizeof(KeyT) + header.count * (sizeof(KeyT) + sizeof(ValueT)))};
+            if (!checkpoint_read(in, page.body.data(), page.body.size())) {
+                break;
+            }
+            pending.push_back(std::move(page));
+            continue;
+        }
+        if (header.record != CheckpointRecord::End || header.count != pending.size() ||
+            !checkpoint_verify_pages(pending, thread_count)) {
+            return false;
+        }
+
+        // Pages are in key order with disjoint ranges, each replaces its range
+        bool complete = header.flags & CheckpointHeader::kComplete;
+        if (!complete && !found_complete) {
+            return false;
+        }
+        Entries next;
+        std::size_t i = 0;
+        for (const Page &page : pending) {
+            const char* body = page.body.data();
+            KeyT lo, hi;
+            std::memcpy(&lo, body, sizeof(KeyT));
+            std::memcpy(&hi, body + sizeof(KeyT), sizeof(KeyT));
+            bool has_lo = page.header.flags & CheckpointHeader::kHasLo;
+            bool has_hi = page.header.flags & CheckpointHeader::kHasHi;
+
+            if (complete) {
+                i = state.size();
+            }
+            while (i < state.size() && has_lo && !comparator(lo, state[i].first)) {
+                next.push_back(std::move(state[i++]));
+            }
+            while (i < state.size() && (!has_hi || !comparator(hi, state[i].first))) {
+                i++;
+            }
+            const char* keys = body + 2 * sizeof(KeyT);
+            const char* values = keys + page.header.count * sizeof(KeyT);
+            for (std::size_t j = 0; j < page.header.count; j++) {
+                std::pair<KeyT, ValueT> entry;
+                std::memcpy(&entry.first, keys + j * sizeof(KeyT), sizeof(KeyT));
+                std::memcpy(&entry.second, values + j * sizeof(ValueT), sizeof(ValueT));
+                next.push_back(entry);
+            }
+        }
+        if (!complete) {
+            next.insert(next.end(), state.begin() + i, state.end());
+        }
+        state.swap(next);
+        pending.clear();
+        found_complete = true;
+        position = header.log_position;
+    }
+
+    if (!found_complete || !tree.bulk_load(state.begin(), state.end())) {
+        return false;
+    }
+    if (log_position) {
+        *log_position = position;
+    }
+    return true;
+}
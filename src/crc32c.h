@@ -0,0 +1,60 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// CRC32C (Castagnoli), as used by iSCSI, ext4 and most storage formats. Uses the
+// SSE4.2 crc32 instruction when the CPU has it and a table otherwise.
+
+// Table-driven CRC32C, one byte per step
+inline uint32_t crc32c_table(uint32_t crc, const void* data, std::size_t size) {
+    static const std::array<uint32_t, 256> table = [] {
+        std::array<uint32_t, 256> t{};
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int bit = 0; bit < 8; bit++) {
+                c = c & 1 ? (c >> 1) ^ 0x82F63B78u : c >> 1;
+            }
+            t[i] = c;
+        }
+        return t;
+    }();
+
+    auto* bytes = static_cast<const unsigned char*>(data);
+    crc = ~crc;
+    for (std::size_t i = 0; i < size; i++) {
+        crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+// Eight bytes per instruction
+__attribute__((target("sse4.2")))
+inline uint32_t crc32c_sse42(uint32_t crc, const void* data, std::size_t size) {
+    auto* bytes = static_cast<const unsigned char*>(data);
+    uint64_t c = ~crc;
+    for (; size >= 8; size -= 8, bytes += 8) {
+        uint64_t word;
+        std::memcpy(&word, bytes, 8);
+        c = __builtin_ia32_crc32di(c, word);
+    }
+    uint32_t c32 = static_cast<uint32_t>(c);
+    for (; size > 0; size--, bytes++) {
+        c32 = __builtin_ia32_crc32qi(c32, *bytes);
+    }
+    return ~c32;
+}
+#endif
+
+// CRC32C of data, continuing from crc (0 to start)
+inline uint32_t crc32c(uint32_t crc, const void* data, std::size_t size) {
+#if defined(__x86_64__)
+    static const bool has_sse42 = __builtin_cpu_supports("sse4.2");
+    if (has_sse42) {
+        return crc32c_sse42(crc, data, size);
+    }
+#endif
+    return crc32c_table(crc, data, size);
+}
@@ -0,0 +1,279 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+#include "btree.h"
+#include "key_encoding.h"
+
+// Differential fuzz target: decodes bytes into operations on small-capacity trees,
+// one with uint64_t and one with byte_array keys, and checks every result against
+// std::map. Nodes this small split every few puts, so the split paths, root
+// growth and the fast paths that skip descents run all the time.
+//
+// The standalone build replays inputs or runs random ones:
+//
+//   btree_fuzz [-runs=N] [-seed=S] [input files...]
+//
+// A failing random input is written to crash-<seed> for replay. Build with
+// -DBTREE_FUZZ_MAIN=0 and -fsanitize=fuzzer to run under libFuzzer instead.
+#ifndef BTREE_FUZZ_MAIN
+#define BTREE_FUZZ_MAIN 1
+#endif
+
+// Input being run, written out by the standalone build when a check fails
+static const uint8_t* current_data = nullptr;
+static std::size_t current_size = 0;
+static std::string crash_path;
+
+[[noreturn]] static void fuzz_fail(const char* check, int line) {
+    std::fprintf(stderr, "fuzz_btree.cpp:%d: check failed: %s\n", line, check);
+    if (!crash_path.empty()) {
+        std::ofstream(crash_path, std::ios::binary).write(reinterpret_cast<const char*>(current_data),
+                                                          static_cast<std::streamsize>(current_size));
+        std::fprintf(stderr, "Input written to %s, replay with: btree_fuzz %s\n", crash_path.c_str(),
+                     crash_path.c_str());
+    }
+    std::abort();
+}
+
+#define FUZZ_CHECK(cond) \
+    do { if (!(cond)) fuzz_fail(#cond, __LINE__); } while (0)
+
+// Reads the input front to back, zeros once it is used up
+struct FuzzInput {
+    const uint8_t* data;
+    std::size_t size;
+    std::size_t pos = 0;
+
+    bool done() const {
+        return pos >= size;
+    }
+
+    uint8_t next() {
+        return pos < size ? data[pos++] : 0;
+    }
+};
+
+// Keys from one byte, so that operations often hit existing keys
+struct U64Keys {
+    using Tree = Btree<uint64_t, uint64_t, std::less<uint64_t>, 4>;
+    using ModelKey = uint64_t;
+
+    uint64_t read(FuzzInput &in) {
+        return in.next();
+    }
+
+    static ModelKey model_key(uint64_t key) {
+        return key;
+    }
+};
+
+// Keys of up to three bytes from a small alphabet, so that keys are often
+// prefixes of each other and hold zeros and 0xFF
+struct ByteKeys {
+    using Tree = Btree<byte_array, uint64_t, less_bytes, 5>;
+    using ModelKey = std::vector<unsigned char>;
+
+    // Bytes of every key handed out, the tree keeps pointers into them
+    std::deque<ModelKey> storage;
+
+    byte_array read(FuzzInput &in) {
+        static constexpr unsigned char kAlphabet[] = {0x00, 0x01, 0x7F, 0xFF};
+        uint8_t b = in.next();
+        ModelKey bytes;
+        for (std::size_t i = 0; i < b % 4u; i++) {
+            bytes.push_back(kAlphabet[(b >> (2 + 2 * i)) & 3]);
+        }
+        storage.push_back(std::move(bytes));
+        return byte_array{storage.back().data(), storage.back().size()};
+    }
+
+    static ModelKey model_key(const byte_array &key) {
+        return ModelKey(key.data, key.data + key.size);
+    }
+};
+
+enum class FuzzOp : uint8_t { Put, Get, Erase, Scan, Append, Merge, GetSorted, Count };
+
+template<typename KeysT>
+static void run_ops(const uint8_t* data, std::size_t size) {
+    using Tree = typename KeysT::Tree;
+    using KeyT = typename Tree::Key;
+    using ModelKey = typename KeysT::ModelKey;
+    const typename Tree::Comparator comparator{};
+
+    KeysT keys;
+    Tree tree;
+    std::map<ModelKey, uint64_t> model;
+    typename Tree::AppendHint hint;
+    bool appended = false;
+    uint64_t value = 0;
+
+    // Model entries with lo <= key <= hi, at most limit of them
+    auto model_range = [&model](const ModelKey &lo, const ModelKey &hi, std::size_t limit) {
+        std::vector<std::pair<ModelKey, uint64_t>> entries;
+        if (hi < lo) {
+            return entries;
+        }
+        for (auto it = model.lower_bound(lo); it != model.end() && !(hi < it->first) && entries.size() < limit; ++it) {
+            entries.push_back(*it);
+        }
+        return entries;
+    };
+
+    FuzzInput in{data, size};
+    while (!in.done()) {
+        auto op = static_cast<FuzzOp>(in.next() % static_cast<uint8_t>(FuzzOp::Count));
+        value++;
+        switch (op) {
+        case FuzzOp::Put: {
+            KeyT key = keys.read(in);
+            tree.put(key, value);
+            model[KeysT::model_key(key)] = value;
+            break;
+        }
+        case FuzzOp::Get: {
+            KeyT key = keys.read(in);
+            auto it = model.find(KeysT::model_key(key));
+            auto found = tree.get(key);
+            FUZZ_CHECK(found.has_value() == (it != model.end()));
+            FUZZ_CHECK(!found || *found == it->second);
+            break;
+        }
+        case FuzzOp::Erase: {
+            KeyT key = keys.read(in);
+            bool erased = tree.erase(key);
+            FUZZ_CHECK(erased == (model.erase(KeysT::model_key(key)) == 1));
+            break;
+        }
+        case FuzzOp::Scan: {
+            KeyT lo = keys.read(in);
+            KeyT hi = keys.read(in);
+            // Stop early after limit entries, 0 scans to the end
+            std::size_t limit = in.next() % 8;
+            limit = limit ? limit : SIZE_MAX;
+            std::vector<std::pair<ModelKey, uint64_t>> scanned;
+            tree.scan(lo, hi, [&scanned, limit](const KeyT &key, const uint64_t &v) {
+                scanned.emplace_back(KeysT::model_key(key), v);
+                return scanned.size() < limit;
+            });
+            FUZZ_CHECK(scanned == model_range(KeysT::model_key(lo), KeysT::model_key(hi), limit));
+            break;
+        }
+        case FuzzOp::Append: {
+            // Keys appended with one hint must increase, others go in with put
+            KeyT key = keys.read(in);
+            if (!appended || comparator(hint.last, key)) {
+                tree.append(key, value, hint);
+                appended = true;
+            }
+            else {
+                tree.put(key, value);
+            }
+            model[KeysT::model_key(key)] = value;
+            break;
+        }
+        case FuzzOp::Merge: {
+            std::vector<std::pair<KeyT, uint64_t>> batch;
+            for (std::size_t n = in.next() % 8 + 1; n > 0; n--) {
+                batch.emplace_back(keys.read(in), value++);
+            }
+            std::stable_sort(batch.begin(), batch.end(), [&comparator](const auto &a, const auto &b) {
+                return comparator(a.first, b.first);
+            });
+            tree.merge_sorted(batch.begin(), batch.end());
+            for (const auto &[key, v] : batch) {
+                model[KeysT::model_key(key)] = v;
+            }
+            break;
+        }
+        case FuzzOp::GetSorted: {
+            std::vector<KeyT> batch;
+            for (std::size_t n = in.next() % 8 + 1; n > 0; n--) {
+                batch.push_back(keys.read(in));
+            }
+            std::sort(batch.begin(), batch.end(), comparator);
+            tree.get_sorted(batch.begin(), batch.end(), [&](std::size_t i, const uint64_t* found) {
+                auto it = model.find(KeysT::model_key(batch[i]));
+                FUZZ_CHECK((found != nullptr) == (it != model.end()));
+                FUZZ_CHECK(!found || *found == it->second);
+            });
+            break;
+        }
+        case FuzzOp::Count:
+            break;
+        }
+    }
+
+    // The whole tree in order
+    std::vector<std::pair<ModelKey, uint64_t>> scanned;
+    for (auto cursor = tree.cursor(); cursor.valid(); cursor.next()) {
+        scanned.emplace_back(KeysT::model_key(cursor.key()), cursor.value());
+    }
+    std::vector<std::pair<ModelKey, uint64_t>> expected(model.begin(), model.end());
+    FUZZ_CHECK(scanned == expected);
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, std::size_t size) {
+    current_data = data;
+    current_size = size;
+    run_ops<U64Keys>(data, size);
+    run_ops<ByteKeys>(data, size);
+    return 0;
+}
+
+#if BTREE_FUZZ_MAIN
+int main(int argc, char** argv) {
+    uint64_t runs = 10000;
+    uint64_t seed = 1;
+    std::vector<std::string> files;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.rfind("-runs=", 0) == 0) {
+            runs = std::strtoull(arg.c_str() + 6, nullptr, 10);
+        }
+        else if (arg.rfind("-seed=", 0) == 0) {
+            seed = std::strtoull(arg.c_str() + 6, nullptr, 10);
+        }
+        else {
+            files.push_back(arg);
+        }
+    }
+
+    if (!files.empty()) {
+        for (const std::string &file : files) {
+            std::ifstream stream(file, std::ios::binary);
+            if (!stream) {
+                std::fprintf(stderr, "cannot read %s\n", file.c_str());
+                return 1;
+            }
+            std::vector<uint8_t> input((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+            LLVMFuzzerTestOneInput(input.data(), input.size());
+        }
+        std::printf("%zu inputs passed.\n", files.size());
+        return 0;
+    }
+
+    // Random inputs of up to 4 KiB, each from its own seed
+    for (uint64_t run = 0; run < runs; run++) {
+        std::mt19937_64 rng(seed + run);
+        std::vector<uint8_t> input(rng() % 4096);
+        for (uint8_t &byte : input) {
+            byte = static_cast<uint8_t>(rng());
+        }
+        crash_path = "crash-" + std::to_string(seed + run);
+        LLVMFuzzerTestOneInput(input.data(), input.size());
+    }
+    std::printf("%llu random inputs passed.\n", static_cast<unsigned long long>(runs));
+    return 0;
+}
+#endif
@@ -0,0 +1,137 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Equi-depth histogram of the keys of a Btree for query planning. It is built from
+// the parents of the leaves: each contributes its key range and an entry count
+// estimated from one of its leaves, so building reads about one leaf in
+// kCapacity. Refreshing revisits only the parents changed since the last refresh.
+// Bucket boundaries fall on parent boundaries, so buckets are only as fine as the
+// key ranges of the parents.
+template<typename TreeT>
+struct EquiDepthHistogram {
+    using KeyT = typename TreeT::Key;
+    using ComparatorT = typename TreeT::Comparator;
+
+    // Keys in (upper of the previous bucket, upper]; the last bucket is unbounded
+    struct Bucket {
+        KeyT upper;
+        bool bounded;
+        std::size_t count;
+    };
+
+    // Key range (lo, hi] of a parent of leaves with its estimated entries
+    struct Span {
+        KeyT lo;
+        KeyT hi;
+        bool has_lo;
+        bool has_hi;
+        std::size_t count;
+    };
+
+    TreeT &tree;
+    std::size_t bucket_count;
+    std::vector<Bucket> buckets;
+    // Spans of all parents in key order, kept for incremental refreshes
+    std::vector<Span> spans;
+    // Tree version the spans reflect, 0 before the first refresh
+    uint64_t version = 0;
+
+    // Constructor
+    EquiDepthHistogram(TreeT &tree, std::size_t bucket_count) : tree(tree), bucket_count(bucket_count) {}
+
+    // Catch up with the tree and recut the buckets. Writers wait while the changed
+    // parents are visited. Returns the number of parents visited.
+    std::size_t refresh() {
+        std::vector<Span> changed;
+        auto changes = tree.visit_changed_parents(version,
+            [&changed](const KeyT* lo, const KeyT* hi, std::size_t, std::size_t count) {
+                changed.push_back(Span{lo ? *lo : KeyT{}, hi ? *hi : KeyT{}, lo != nullptr, hi != nullptr, count});
+            });
+        version = changes.version;
+        std::size_t visited = changed.size();
+
+        if (changes.complete) {
+            spans.swap(changed);
+        }
+        else {
+            // Changed parents replace every old span they overlap; parents that
+            // split are all visited, so together they cover the old span
+            std::size_t j = 0;
+            for (const Span &span : spans) {
+                while (j < visited && ends_before(changed[j], span)) {
+                    j++;
+                }
+                if (j == visited || ends_before(span, changed[j])) {
+                    changed.push_back(span);
+                }
+            }
+            const ComparatorT comparator{};
+            std::stable_sort(changed.begin(), changed.end(), [&comparator](const Span &a, const Span &b) {
+                return a.has_hi && (!b.has_hi || comparator(a.hi, b.hi));
+            });
+            spans.swap(changed);
+        }
+        cut_buckets();
+        return visited;
+    }
+
+    // Estimated entries with lo <= key <= hi. Buckets wholly inside count fully,
+    // buckets holding lo or hi count half, as do the open first and last buckets.
+    std::size_t estimate(const KeyT &lo, const KeyT &hi) const {
+        const ComparatorT comparator{};
+        std::size_t total = 0;
+        for (std::size_t i = 0; i < buckets.size(); i++) {
+            const Bucket* previous = i > 0 ? &buckets[i - 1] : nullptr;
+            // Bucket ends before lo, or starts after hi
+            if ((buckets[i].bounded && comparator(buckets[i].upper, lo)) ||
+                (previous && !comparator(previous->upper, hi))) {
+                continue;
+            }
+            bool holds_lo = !previous || comparator(previous->upper, lo);
+            bool holds_hi = !buckets[i].bounded || comparator(hi, buckets[i].upper);
+            total += holds_lo || holds_hi ? buckets[i].count / 2 : buckets[i].count;
+        }
+        return total;
+    }
+
+    // Entries in all buckets
+    std::size_t total() const {
+        std::size_t sum = 0;
+        for (const Bucket &bucket : buckets) {
+            sum += bucket.count;
+        }
+        return sum;
+    }
+
+private:
+    // Whether a ends at or before the start of b
+    static bool ends_before(const Span &a, const Span &b) {
+        return a.has_hi && b.has_lo && !ComparatorT{}(b.lo, a.hi);
+    }
+
+    void cut_buckets() {
+        buckets.clear();
+        std::size_t sum = 0;
+        for (const Span &span : spans) {
+            sum += span.count;
+        }
+        std::size_t count = 0;
+        std::size_t closed = 0;
+        for (const Span &span : spans) {
+            count += span.count;
+            closed += span.count;
+            // Close the bucket once it reaches its share of the entries
+            if (span.has_hi && count > 0 && buckets.size() + 1 < bucket_count &&
+                closed * bucket_count >= sum * (buckets.size() + 1)) {
+                buckets.push_back(Bucket{span.hi, true, count});
+                count = 0;
+            }
+        }
+        if (!spans.empty()) {
+            buckets.push_back(Bucket{KeyT{}, false, count});
+        }
+    }
+};
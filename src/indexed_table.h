@@ -0,0 +1,219 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include "btree.h"
+
+// A primary tree of rows with secondary indexes kept in sync with it. An index is
+// described by a spec type:
+//
+//   struct ByCity {
+//       using Key = uint32_t;
+//       using Comparator = std::less<uint32_t>;
+//       static Key key(const Row &row) { return row.city; }
+//       // Optional: columns stored in the index, for index-only scans
+//       using Covered = uint64_t;
+//       static Covered cover(const Row &row) { return row.balance; }
+//   };
+//
+// Indexes are non-unique: each entry is the index key made unique by the primary
+// key, so many rows can share an index key.
+
+// Columns of an index spec without Covered
+struct NoColumns {};
+
+// Entry of a secondary index. Bound entries sort before or after all entries with
+// their index key and only serve as scan limits.
+template<typename IndexKeyT, typename PrimaryKeyT>
+struct IndexEntry {
+    IndexKeyT key;
+    PrimaryKeyT primary;
+    // -1 before, 1 after every entry with this key, 0 for stored entries
+    int8_t bound = 0;
+};
+
+template<typename IndexComparatorT, typename PrimaryComparatorT>
+struct IndexEntryLess {
+    template<typename EntryT>
+    bool operator()(const EntryT &a, const EntryT &b) const {
+        const IndexComparatorT key_less{};
+        if (key_less(a.key, b.key)) {
+            return true;
+        }
+        if (key_less(b.key, a.key)) {
+            return false;
+        }
+        if (a.bound != 0 || b.bound != 0) {
+            return a.bound < b.bound;
+        }
+        return PrimaryComparatorT{}(a.primary, b.primary);
+    }
+};
+
+// Covered columns of a row under an index spec
+template<typename IndexT, typename RowT>
+auto index_cover(const RowT &row) {
+    if constexpr (requires { typename IndexT::Covered; }) {
+        return IndexT::cover(row);
+    }
+    else {
+        return NoColumns{};
+    }
+}
+
+// Writers are serialized by the table, readers are not. An index entry is added
+// after its row is stored and removed before its row is erased, so an entry found
+// in an index always leads to a row, though the row may have changed since.
+// Changes to several rows can be batched and are then merged into every tree with
+// one descent per parent of leaves.
+template<typename KeyT, typename ValueT, typename ComparatorT, std::size_t kCapacity, typename... IndexTs>
+struct IndexedTable {
+    using Primary = Btree<KeyT, ValueT, ComparatorT, kCapacity>;
+
+    template<std::size_t I>
+    using IndexSpec = std::tuple_element_t<I, std::tuple<IndexTs...>>;
+
+    template<typename IndexT>
+    using EntryOf = IndexEntry<typename IndexT::Key, KeyT>;
+
+    template<typename IndexT>
+    using CoveredOf = decltype(index_cover<IndexT>(std::declval<const ValueT&>()));
+
+    template<typename IndexT>
+    using SecondaryOf = Btree<EntryOf<IndexT>, CoveredOf<IndexT>,
+                              IndexEntryLess<typename IndexT::Comparator, ComparatorT>, kCapacity>;
+
+    // Changes applied together by commit, later changes of a key win
+    struct Batch {
+        // A row to store, or nullopt to erase the key
+        std::vector<std::pair<KeyT, std::optional<ValueT>>> changes;
+
+        void put(const KeyT &key, const ValueT &value) {
+            changes.emplace_back(key, value);
+        }
+
+        void erase(const KeyT &key) {
+            changes.emplace_back(key, std::nullopt);
+        }
+    };
+
+    Primary primary;
+    std::tuple<SecondaryOf<IndexTs>...> secondaries;
+    // Held by writers, so that no row changes between reading and replacing it
+    std::mutex write_mutex;
+
+    std::optional<ValueT> get(const KeyT &key) {
+        return primary.get(key);
+    }
+
+    void put(const KeyT &key, const ValueT &value) {
+        Batch batch;
+        batch.put(key, value);
+        commit(batch);
+    }
+
+    // Does nothing if there is no row for key
+    void erase(const KeyT &key) {
+        Batch batch;
+        batch.erase(key);
+        commit(batch);
+    }
+
+    // Apply a batch to the primary tree and all indexes, then clear it
+    void commit(Batch &batch) {
+        const ComparatorT comparator{};
+        auto &changes = batch.changes;
+        std::stable_sort(changes.begin(), changes.end(), [&comparator](const auto &a, const auto &b) {
+            return comparator(a.first, b.first);
+        });
+        Primary::keep_last_of_equal_keys(changes);
+
+        std::lock_guard<std::mutex> lock(write_mutex);
+        std::vector<KeyT> keys;
+        std::vector<std::pair<KeyT, ValueT>> rows;
+        for (const auto &[key, row] : changes) {
+            keys.push_back(key);
+            if (row) {
+                rows.emplace_back(key, *row);
+            }
+        }
+        std::vector<std::optional<ValueT>> old_rows(keys.size());
+        primary.get_sorted(keys.begin(), keys.end(), [&old_rows](std::size_t i, const ValueT* row) {
+            if (row) {
+                old_rows[i] = *row;
+            }
+        });
+
+        primary.merge_sorted(rows.begin(), rows.end());
+        update_indexes(changes, old_rows, std::index_sequence_for<IndexTs...>{});
+        for (const auto &[key, row] : changes) {
+            if (!row) {
+                primary.erase(key);
+            }
+        }
+        changes.clear();
+    }
+
+    // Index-only scan: visit fn(index_key, primary_key, covered) for the entries of
+    // index I with lo <= index key <= hi, in index order, until fn returns false.
+    // The primary tree is not read. fn runs under a leaf latch as in Btree::scan.
+    template<std::size_t I, typename Fn>
+    void scan_index(const typename IndexSpec<I>::Key &lo, const typename IndexSpec<I>::Key &hi, Fn &&fn) {
+        using Entry = EntryOf<IndexSpec<I>>;
+        std::get<I>(secondaries).scan(Entry{lo, KeyT{}, -1}, Entry{hi, KeyT{}, 1},
+            [&fn](const Entry &entry, const CoveredOf<IndexSpec<I>> &covered) {
+                return fn(entry.key, entry.primary, covered);
+            });
+    }
+
+    // Tree of index I
+    template<std::size_t I>
+    SecondaryOf<IndexSpec<I>>& index() {
+        return std::get<I>(secondaries);
+    }
+
+private:
+    template<std::size_t... Is>
+    void update_indexes(const std::vector<std::pair<KeyT, std::optional<ValueT>>> &changes,
+                        const std::vector<std::optional<ValueT>> &old_rows, std::index_sequence<Is...>) {
+        (update_index<Is>(changes, old_rows), ...);
+    }
+
+    // New entries go in first, then the entries of replaced and erased rows go
+    template<std::size_t I>
+    void update_index(const std::vector<std::pair<KeyT, std::optional<ValueT>>> &changes,
+                      const std::vector<std::optional<ValueT>> &old_rows) {
+        using IndexT = IndexSpec<I>;
+        using Entry = EntryOf<IndexT>;
+        const IndexEntryLess<typename IndexT::Comparator, ComparatorT> entry_less{};
+        auto &secondary = std::get<I>(secondaries);
+
+        std::vector<std::pair<Entry, CoveredOf<IndexT>>> added;
+        std::vector<Entry> removed;
+        for (std::size_t i = 0; i < changes.size(); i++) {
+            const auto &[key, row] = changes[i];
+            if (row) {
+                added.emplace_back(Entry{IndexT::key(*row), key}, index_cover<IndexT>(*row));
+            }
+            if (old_rows[i]) {
+                Entry old_entry{IndexT::key(*old_rows[i]), key};
+                // An entry that stays was overwritten in place
+                if (!row || entry_less(old_entry, added.back().first) || entry_less(added.back().first, old_entry)) {
+                    removed.push_back(old_entry);
+                }
+            }
+        }
+
+        std::sort(added.begin(), added.end(), [&entry_less](const auto &a, const auto &b) {
+            return entry_less(a.first, b.first);
+        });
+        secondary.merge_sorted(added.begin(), added.end());
+        for (const Entry &entry : removed) {
+            secondary.erase(entry);
+        }
+    }
+};
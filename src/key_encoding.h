@@ -0,0 +1,153 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string_view>
+#include <type_traits>
+
+// Byte string keys and an order-preserving encoding of composite keys into them.
+// Encoded keys compare with memcmp in the order of their fields, so a tree of
+// byte_array keys with less_bytes serves any tuple layout.
+
+// Bytes owned by the caller
+struct byte_array {
+    const unsigned char* data;
+    std::size_t size;
+};
+
+// Lexicographic order of the bytes, a shorter prefix first
+struct less_bytes {
+    bool operator()(const byte_array& a, const byte_array& b) const {
+        std::size_t n = (a.size < b.size) ? a.size : b.size;
+        int c = n ? std::memcmp(a.data, b.data, n) : 0;
+        return c < 0 || (c == 0 && a.size < b.size);
+    }
+};
+
+enum class KeyOrder { Ascending, Descending };
+enum class NullOrder { First, Last };
+
+// A field sorted in reverse
+template<typename T>
+struct Descending {
+    const T &value;
+};
+
+template<typename T>
+Descending<T> descending(const T &value) {
+    return {value};
+}
+
+// Appends fields to a caller buffer, the key sorts by the first field, then the
+// second and so on. Like snprintf, size counts the bytes a key needs even when
+// they did not fit; the key is valid only if fits().
+//
+//   integers    big-endian, the sign bit flipped for signed types
+//   timestamps  signed count of the time_point's duration since its epoch
+//   strings     0x00 escaped as 0x00 0xFF, closed by 0x00 0x01, so no key is a
+//               prefix of another and embedded zeros keep their order
+//   optionals   a tag byte before the value, nulls first or last in either order
+//   descending  the bytes of the field inverted
+struct KeyEncoder {
+    static constexpr unsigned char kNullFirst = 0x00;
+    static constexpr unsigned char kPresent = 0x01;
+    static constexpr unsigned char kNullLast = 0x02;
+
+    unsigned char* buffer;
+    std::size_t capacity;
+    std::size_t size = 0;
+
+    // Constructor
+    KeyEncoder(unsigned char* buffer, std::size_t capacity) : buffer(buffer), capacity(capacity) {}
+
+    bool fits() const {
+        return size <= capacity;
+    }
+
+    byte_array key() const {
+        return byte_array{buffer, fits() ? size : 0};
+    }
+
+    // Start over on the same buffer
+    void clear() {
+        size = 0;
+    }
+
+    template<typename T, typename = std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, bool>>>
+    KeyEncoder& add(T value, KeyOrder order = KeyOrder::Ascending) {
+        using U = std::make_unsigned_t<T>;
+        U bits = static_cast<U>(value);
+        if constexpr (std::is_signed_v<T>) {
+            bits = static_cast<U>(bits ^ (U{1} << (sizeof(T) * 8 - 1)));
+        }
+        unsigned char mask = flip(order);
+        for (std::size_t i = sizeof(T); i-- > 0;) {
+            write(static_cast<unsigned char>(bits >> (i * 8)) ^ mask);
+        }
+        return *this;
+    }
+
+    template<typename Clock, typename Duration>
+    KeyEncoder& add(std::chrono::time_point<Clock, Duration> time, KeyOrder order = KeyOrder::Ascending) {
+        return add(static_cast<int64_t>(time.time_since_epoch().count()), order);
+    }
+
+    KeyEncoder& add(std::string_view text, KeyOrder order = KeyOrder::Ascending) {
+        unsigned char mask = flip(order);
+        for (char c : text) {
+            write(static_cast<unsigned char>(c) ^ mask);
+            if (c == 0) {
+                write(0xFF ^ mask);
+            }
+        }
+        write(0x00 ^ mask);
+        write(0x01 ^ mask);
+        return *this;
+    }
+
+    KeyEncoder& add(const char* text, KeyOrder order = KeyOrder::Ascending) {
+        return add(std::string_view(text), order);
+    }
+
+    template<typename T>
+    KeyEncoder& add(const std::optional<T> &value, KeyOrder order = KeyOrder::Ascending,
+                    NullOrder nulls = NullOrder::First) {
+        if (!value) {
+            write(nulls == NullOrder::First ? kNullFirst : kNullLast);
+            return *this;
+        }
+        write(kPresent);
+        return add(*value, order);
+    }
+
+    template<typename T, typename... Options>
+    KeyEncoder& add(Descending<T> field, Options... options) {
+        return add(field.value, KeyOrder::Descending, options...);
+    }
+
+private:
+    static unsigned char flip(KeyOrder order) {
+        return order == KeyOrder::Descending ? 0xFF : 0x00;
+    }
+
+    void write(unsigned char byte) {
+        if (size < capacity) {
+            buffer[size] = byte;
+        }
+        size++;
+    }
+};
+
+// Encode fields into buffer and return the key, or nullopt if it needs more than
+// capacity bytes
+template<typename... Fields>
+std::optional<byte_array> encode_key(unsigned char* buffer, std::size_t capacity, const Fields &... fields) {
+    KeyEncoder encoder(buffer, capacity);
+    (encoder.add(fields), ...);
+    if (!encoder.fits()) {
+        return std::nullopt;
+    }
+    return encoder.key();
+}
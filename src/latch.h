@@ -0,0 +1,178 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <thread>
+
+// Reader/writer latches usable as the LatchT of a Btree. Both are a few bytes
+// of atomics, spin briefly and then sleep on the atomic (futex) while waiting.
+
+// Spin a little before going to sleep on an atomic
+template<typename PredT>
+inline bool spin_until(PredT &&ready) {
+    for (int i = 0; i < 64; i++) {
+        if (ready()) {
+            return true;
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+    return ready();
+}
+
+// Writers announce themselves and new readers back off until every waiting
+// writer got its turn. Readers can starve under a constant stream of writers.
+struct WriterPreferringLatch {
+    static constexpr uint32_t kWriter = 1u << 31;
+
+    // Reader count, plus kWriter while a writer holds the latch
+    std::atomic<uint32_t> state{0};
+    // Writers that are waiting or holding the latch
+    std::atomic<uint32_t> writers{0};
+
+    void lock_shared() {
+        while (true) {
+            uint32_t w = writers.load(std::memory_order_relaxed);
+            if (w != 0) {
+                if (!spin_until([&] { return writers.load(std::memory_order_relaxed) == 0; })) {
+                    writers.wait(w, std::memory_order_relaxed);
+                }
+                continue;
+            }
+            if (try_lock_shared()) {
+                return;
+            }
+        }
+    }
+
+    bool try_lock_shared() {
+        uint32_t s = state.load(std::memory_order_relaxed);
+        return !(s & kWriter) && writers.load(std::memory_order_relaxed) == 0 &&
+               state.compare_exchange_strong(s, s + 1, std::memory_order_acquire, std::memory_order_relaxed);
+    }
+
+    void unlock_shared() {
+        if (state.fetch_sub(1, std::memory_order_release) == 1) {
+            state.notify_all();
+        }
+    }
+
+    void lock() {
+        writers.fetch_add(1, std::memory_order_relaxed);
+        while (true) {
+            uint32_t s = 0;
+            if (state.compare_exchange_weak(s, kWriter, std::memory_order_acquire, std::memory_order_relaxed)) {
+                return;
+            }
+            if (!spin_until([&] { return state.load(std::memory_order_relaxed) == 0; })) {
+                state.wait(s, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool try_lock() {
+        uint32_t s = 0;
+        if (!state.compare_exchange_strong(s, kWriter, std::memory_order_acquire, std::memory_order_relaxed)) {
+            return false;
+        }
+        writers.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    void unlock() {
+        state.store(0, std::memory_order_release);
+        state.notify_all();
+        if (writers.fetch_sub(1, std::memory_order_relaxed) == 1) {
+            writers.notify_all();
+        }
+    }
+};
+
+// Phase-fair ticket latch (Brandenburg and Anderson, PF-T). Reader and writer
+// phases alternate: a waiting writer blocks later readers, and a releasing
+// writer admits all readers that queued up behind it before the next writer.
+struct PhaseFairLatch {
+    static constexpr uint32_t kReaderIncrement = 0x100;
+    static constexpr uint32_t kWriterBits = 0x3;
+    static constexpr uint32_t kPresent = 0x2;
+    static constexpr uint32_t kPhase = 0x1;
+
+    std::atomic<uint32_t> rin{0};
+    std::atomic<uint32_t> rout{0};
+    std::atomic<uint32_t> win{0};
+    std::atomic<uint32_t> wout{0};
+
+    void lock_shared() {
+        uint32_t w = rin.fetch_add(kReaderIncrement, std::memory_order_acquire) & kWriterBits;
+        if (w == 0) {
+            return;
+        }
+        // Wait for the writer phase we arrived in to end
+        while (true) {
+            uint32_t current = rin.load(std::memory_order_acquire);
+            if ((current & kWriterBits) != w) {
+                return;
+            }
+            if (!spin_until([&] { return (rin.load(std::memory_order_acquire) & kWriterBits) != w; })) {
+                rin.wait(current, std::memory_order_acquire);
+            }
+        }
+    }
+
+    bool try_lock_shared() {
+        uint32_t current = rin.load(std::memory_order_relaxed);
+        return !(current & kWriterBits) &&
+               rin.compare_exchange_strong(current, current + kReaderIncrement, std::memory_order_acquire,
+                                           std::memory_order_relaxed);
+    }
+
+    void unlock_shared() {
+        rout.fetch_add(kReaderIncrement, std::memory_order_release);
+        rout.notify_all();
+    }
+
+    void lock() {
+        uint32_t ticket = win.fetch_add(1, std::memory_order_relaxed);
+        wait_equal(wout, ticket);
+        uint32_t readers = rin.fetch_add(kPresent | (ticket & kPhase), std::memory_order_acquire);
+        wait_equal(rout, readers);
+    }
+
+    // Only succeeds if neither writers nor readers hold or wait for the latch
+    bool try_lock() {
+        uint32_t ticket = wout.load(std::memory_order_relaxed);
+        if (!win.compare_exchange_strong(ticket, ticket + 1, std::memory_order_relaxed)) {
+            return false;
+        }
+        uint32_t readers = rin.load(std::memory_order_relaxed);
+        if (readers == rout.load(std::memory_order_acquire) &&
+            rin.compare_exchange_strong(readers, readers | kPresent | (ticket & kPhase), std::memory_order_acquire,
+                                        std::memory_order_relaxed)) {
+            return true;
+        }
+        // Hand the ticket on as if we had locked and unlocked
+        wout.fetch_add(1, std::memory_order_release);
+        wout.notify_all();
+        return false;
+    }
+
+    void unlock() {
+        rin.fetch_and(~kWriterBits, std::memory_order_release);
+        rin.notify_all();
+        wout.fetch_add(1, std::memory_order_release);
+        wout.notify_all();
+    }
+
+private:
+    static void wait_equal(std::atomic<uint32_t> &value, uint32_t expected) {
+        while (true) {
+            uint32_t current = value.load(std::memory_order_acquire);
+            if (current == expected) {
+                return;
+            }
+            if (!spin_until([&] { return value.load(std::memory_order_acquire) == expected; })) {
+                value.wait(current, std::memory_order_acquire);
+            }
+        }
+    }
+};
@@ -0,0 +1,148 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+
+// Small dense id for the calling thread, used to pick per-thread slots
+inline unsigned thread_ordinal() {
+    static std::atomic<unsigned> next_ordinal{0};
+    thread_local unsigned ordinal = next_ordinal.fetch_add(1, std::memory_order_relaxed);
+    return ordinal;
+}
+
+// Monotonic timestamp in nanoseconds
+inline uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Log-linear histogram in the style of HdrHistogram. Values below kSubBuckets are
+// exact, larger values keep kSubBucketBits bits of precision (about 6% error).
+struct LatencyHistogram {
+    static constexpr unsigned kSubBucketBits = 4;
+    static constexpr unsigned kSubBuckets = 1u << kSubBucketBits;
+    // Largest tracked exponent, 2^40 ns is roughly 18 minutes
+    static constexpr unsigned kMaxExponent = 40;
+    static constexpr unsigned kBucketCount = (kMaxExponent - kSubBucketBits + 2) * kSubBuckets;
+
+    uint64_t counts[kBucketCount] = {};
+    uint64_t total = 0;
+
+    // Map a value to its bucket
+    static unsigned bucket_index(uint64_t value) {
+        if (value < kSubBuckets) {
+            return static_cast<unsigned>(value);
+        }
+        unsigned exponent = 63 - __builtin_clzll(value);
+        if (exponent > kMaxExponent) {
+            return kBucketCount - 1;
+        }
+        unsigned shift = exponent - kSubBucketBits;
+        unsigned sub = static_cast<unsigned>(value >> shift) - kSubBuckets;
+        return (shift + 1) * kSubBuckets + sub;
+    }
+
+    // Highest value that falls into a bucket
+    static uint64_t bucket_value(unsigned index) {
+        if (index < kSubBuckets) {
+            return index;
+        }
+        unsigned shift = index / kSubBuckets - 1;
+        uint64_t sub = index % kSubBuckets;
+        return ((kSubBuckets + sub) << shift) + ((uint64_t{1} << shift) - 1);
+    }
+
+    void add(unsigned index, uint64_t count) {
+        counts[index] += count;
+        total += count;
+    }
+
+    void merge(const LatencyHistogram &other) {
+        for (unsigned i = 0; i < kBucketCount; i++) {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+    }
+
+    // Value at a quantile in [0, 1], e.g. 0.99 for p99
+    uint64_t percentile(double quantile) const {
+        if (total == 0) {
+            return 0;
+        }
+        uint64_t rank = static_cast<uint64_t>(quantile * static_cast<double>(total - 1)) + 1;
+        uint64_t seen = 0;
+        for (unsigned i = 0; i < kBucketCount; i++) {
+            seen += counts[i];
+            if (seen >= rank) {
+                return bucket_value(i);
+            }
+        }
+        return bucket_value(kBucketCount - 1);
+    }
+
+    uint64_t max() const {
+        for (unsigned i = kBucketCount; i > 0; i--) {
+            if (counts[i - 1]) {
+                return bucket_value(i - 1);
+            }
+        }
+        return 0;
+    }
+};
+
+// Concurrent recorder for kKinds histograms. Each thread writes to its own slot
+// and the slots are merged when read.
+template<std::size_t kKinds>
+struct LatencyRecorder {
+    static constexpr std::size_t kSlots = 16;
+
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> counts[kKinds][LatencyHistogram::kBucketCount];
+        // Descents that started over because a writer replaced the node they latched
+        std::atomic<uint64_t> restarts;
+    };
+
+    std::unique_ptr<Slot[]> slots{new Slot[kSlots]()};
+
+    void record(std::size_t kind, uint64_t nanos) {
+        Slot &slot = slots[thread_ordinal() % kSlots];
+        slot.counts[kind][LatencyHistogram::bucket_index(nanos)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void record_restart() {
+        slots[thread_ordinal() % kSlots].restarts.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    uint64_t restart_count() const {
+        uint64_t total = 0;
+        for (std::size_t s = 0; s < kSlots; s++) {
+            total += slots[s].restarts.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    LatencyHistogram merged(std::size_t kind) const {
+        LatencyHistogram result;
+        for (std::size_t s = 0; s < kSlots; s++) {
+            for (unsigned i = 0; i < LatencyHistogram::kBucketCount; i++) {
+                uint64_t c = slots[s].counts[kind][i].load(std::memory_order_relaxed);
+                if (c) {
+                    result.add(i, c);
+                }
+            }
+        }
+        return result;
+    }
+
+    void reset() {
+        for (std::size_t s = 0; s < kSlots; s++) {
+            for (std::size_t k = 0; k < kKinds; k++) {
+                for (auto &c : slots[s].counts[k]) {
+                    c.store(0, std::memory_order_relaxed);
+                }
+            }
+            slots[s].restarts.store(0, std::memory_order_relaxed);
+        }
+    }
+};
@@ -4,33 +4,30 @@
 #include <vector>
 #include <random>
 #include <chrono>
+#include <fstream>
+#include <functional>
+#include <algorithm>
+#include <map>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <optional>
+#include <mutex>
+#include <condition_variable>
 #include "btree.h"
-
-// Define the type for keys and values
-struct byte_array {
-    const unsigned char* data;
-    std::size_t size;
-};
-
-// Comparator used in the tree
-struct less_bytes {
-    bool operator()(const byte_array& a, const byte_array& b) const {
-        std::size_t n = (a.size < b.size) ? a.size : b.size;
-
-        for (std::size_t i = 0; i < n; ++i) {
-            if (a.data[i] < b.data[i]) return true;
-            if (a.data[i] > b.data[i]) return false;
-        }
-        return a.size < b.size;
-    }
-}; 
+#include "latch.h"
+#include "async_btree.h"
+#include "merge_join.h"
+#include "checkpoint.h"
+#include "key_encoding.h"
+#include "indexed_table.h"
+#include "time_series.h"
+#include "histogram.h"
 
 // Helper functions
 static std::vector<unsigned char> encode_u64_be(uint64_t x) {
     std::vector<unsigned char> v(8);
-    for (int i = 7; i >= 0; i--) {
-        v[7 - i] = static_cast<unsigned char>((x >> (i * 8)) & 0xFF);
-    }
+    KeyEncoder(v.data(), v.size()).add(x);
     return v;
 }
 static byte_array make_ba(std::vector<unsigned char>& v) {
@@ -59,8 +56,9 @@ static bool bytes_equal(const byte_array& a, const byte_array& b) {
         }                                                                     \
     } while (0)
 
-int main() {
-    using Tree = Btree<byte_array, byte_array, less_bytes, 64>;
+template<typename LatchT>
+static void test_multithread_writers() {
+    using Tree = Btree<byte_array, byte_array, less_bytes, 64, LatchT>;
     constexpr size_t LeafCap = 64;
     constexpr size_t kThreads = 8;
 
@@ -108,5 +106,1171 @@ int main() {
     std::chrono::duration<double> elapsed = end - start;
 
     std::cout << "Elapsed time: " << elapsed.count() << " seconds\n";
+
+    if constexpr (Tree::kLatencyStats) {
+        for (int op = 0; op < static_cast<int>(BtreeOp::Count); op++) {
+            LatencyHistogram h = tree.latency_histogram(static_cast<BtreeOp>(op));
+            std::cout << btree_op_name(static_cast<BtreeOp>(op)) << ": count=" << h.total << " p50=" << h.percentile(0.5)
+                      << "ns p99=" << h.percentile(0.99) << "ns max=" << h.max() << "ns\n";
+        }
+        std::cout << "restarts: " << tree.restart_count() << "\n";
+    }
+#if BTREE_TRACING
+    std::ofstream trace_file("btree_trace.json");
+    global_tracer().dump_chrome_json(trace_file);
+    std::cout << "Trace written to btree_trace.json\n";
+#endif
+
     std::cout << "MultithreadWriters test passed.\n";
 }
+
+// Writers never split leaves themselves, the background thread catches up
+static void test_deferred_splits() {
+    using Tree = Btree<uint64_t, uint64_t, std::less<uint64_t>, 8>;
+    constexpr size_t kThreads = 4;
+    constexpr size_t per_thread = 20000;
+
+    Tree tree;
+    tree.enable_deferred_splits();
+
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < kThreads; ++t) {
+        threads.emplace_back([&, t] {
+            for (size_t i = 0; i < per_thread; ++i) {
+                uint64_t key = i * kThreads + t;
+                tree.put(key, key + 1);
+            }
+        });
+    }
+    for (auto& th : threads) th.join();
+
+    tree.wait_for_splits();
+    for (uint64_t key = 0; key < kThreads * per_thread; ++key) {
+        auto res = tree.get(key);
+        ASSERT_TRUE(res.has_value());
+        ASSERT_TRUE(*res == key + 1);
+    }
+    tree.disable_deferred_splits();
+
+    // Toggle the mode from two threads while writers run, splits queued around a
+    // disable must not be stranded without a thread to serve them
+    Tree toggled;
+    std::atomic<bool> writing{true};
+    threads.clear();
+    for (size_t t = 0; t < kThreads; ++t) {
+        threads.emplace_back([&, t] {
+            for (size_t i = 0; i < per_thread; ++i) {
+                uint64_t key = i * kThreads + t;
+                toggled.put(key, key + 1);
+            }
+        });
+    }
+    std::vector<std::thread> togglers;
+    for (int t = 0; t < 2; ++t) {
+        togglers.emplace_back([&] {
+            while (writing.load()) {
+                toggled.enable_deferred_splits();
+                std::this_thread::yield();
+                toggled.disable_deferred_splits();
+            }
+        });
+    }
+    for (auto& th : threads) th.join();
+    writing = false;
+    for (auto& toggler : togglers) toggler.join();
+
+    std::atomic<bool> drained{false};
+    std::thread waiter([&] {
+        toggled.wait_for_splits();
+        drained = true;
+    });
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (!drained.load() && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    ASSERT_TRUE(drained.load());
+    waiter.join();
+    for (uint64_t key = 0; key < kThreads * per_thread; ++key) {
+        ASSERT_TRUE(toggled.get(key) == key + 1);
+    }
+
+    std::cout << "DeferredSplits test passed.\n";
+}
+
+// Non-blocking and deadline-bounded operations give up on a latched node
+static void test_try_operations() {
+    using Tree = Btree<uint64_t, uint64_t, std::less<uint64_t>, 8>;
+    Tree tree;
+    for (uint64_t key = 0; key < 100; ++key) {
+        ASSERT_TRUE(tree.try_put(key, key) == OpStatus::Ok);
+    }
+
+    uint64_t value = 0;
+    tree.root.load()->lock_write();
+    ASSERT_TRUE(tree.try_get(5, value) == OpStatus::Busy);
+    ASSERT_TRUE(tree.try_put(5, 6) == OpStatus::Busy);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(1);
+    ASSERT_TRUE(tree.get_until(5, value, deadline) == OpStatus::Busy);
+    ASSERT_TRUE(tree.put_until(5, 6, deadline) == OpStatus::Busy);
+    tree.root.load()->unlock_write();
+
+    ASSERT_TRUE(tree.try_get(5, value) == OpStatus::Ok && value == 5);
+    deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(1);
+    ASSERT_TRUE(tree.put_until(5, 6, deadline) == OpStatus::Ok);
+    ASSERT_TRUE(tree.get_until(5, value, deadline) == OpStatus::Ok && value == 6);
+    ASSERT_TRUE(tree.try_get(1000, value) == OpStatus::NotFound);
+
+    std::cout << "TryOperations test passed.\n";
+}
+
+// Coroutine that starts eagerly and frees itself when done
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::abort(); }
+    };
+};
+
+template<typename AsyncT>
+static DetachedTask await_round_trip(AsyncT& async, uint64_t key, std::atomic<int>& finished) {
+    co_await async.async_put(key, key * 3);
+    auto value = co_await async.async_get(key);
+    ASSERT_TRUE(value.has_value() && *value == key * 3);
+    auto entries = co_await async.async_scan(key, key);
+    ASSERT_TRUE(entries.size() == 1 && entries[0].second == key * 3);
+    finished++;
+}
+
+// Requests complete through callbacks and coroutines on the worker threads
+static void test_async_api() {
+    using Tree = Btree<uint64_t, uint64_t, std::less<uint64_t>, 8>;
+    constexpr uint64_t kKeys = 5000;
+    Tree tree;
+    {
+        AsyncBtree<Tree> async(tree, 4);
+        std::atomic<uint64_t> completed{0};
+        for (uint64_t key = 0; key < kKeys; ++key) {
+            async.async_put(key, key + 1, [&completed] { completed++; });
+        }
+        async.drain();
+        ASSERT_TRUE(completed == kKeys);
+
+        for (uint64_t key = 0; key < kKeys + 10; ++key) {
+            async.async_get(key, [key, &completed](std::optional<uint64_t> value) {
+                ASSERT_TRUE(key < kKeys ? value.has_value() && *value == key + 1 : !value.has_value());
+                completed++;
+            });
+        }
+        async.async_scan(100, 199, [&completed](std::vector<std::pair<uint64_t, uint64_t>> entries) {
+            ASSERT_TRUE(entries.size() == 100);
+            for (size_t i = 0; i < entries.size(); ++i) {
+                ASSERT_TRUE(entries[i].first == 100 + i && entries[i].second == 101 + i);
+            }
+            completed++;
+        });
+        async.drain();
+        ASSERT_TRUE(completed == 2 * kKeys + 11);
+
+        std::atomic<int> finished{0};
+        for (uint64_t key = kKeys; key < kKeys + 100; ++key) {
+            await_round_trip(async, key, finished);
+        }
+        async.drain();
+        ASSERT_TRUE(finished == 100);
+
+        // Puts of one key are applied in the order they were submitted
+        for (uint64_t round = 1; round <= 200; ++round) {
+            for (uint64_t key = 0; key < 16; ++key) {
+                async.async_put(key, round, nullptr);
+            }
+        }
+        async.drain();
+        for (uint64_t key = 0; key < 16; ++key) {
+            ASSERT_TRUE(tree.get(key) == 200);
+        }
+
+        // A get sees the puts of its key submitted before it and none after
+        const uint64_t key = 2 * kKeys;
+        for (uint64_t round = 1; round <= 200; ++round) {
+            async.async_get(key, [round](std::optional<uint64_t> value) {
+                ASSERT_TRUE(round == 1 ? !value.has_value() : value == round - 1);
+            });
+            async.async_put(key, round, nullptr);
+        }
+        async.async_get(key, nullptr);
+        async.drain();
+        ASSERT_TRUE(tree.get(key) == 200);
+    }
+
+    std::cout << "AsyncApi test passed.\n";
+}
+
+// Bottom-up bulk load on several threads, then regular operations on top
+static void test_bulk_load() {
+    using Tree = Btree<uint64_t, uint64_t, std::less<uint64_t>, 16>;
+    constexpr uint64_t kKeys = 200000;
+
+    std::vector<std::pair<uint64_t, uint64_t>> entries;
+    for (uint64_t i = 0; i < kKeys; ++i) {
+        entries.emplace_back(2 * i, i);
+    }
+    Tree tree;
+    ASSERT_TRUE(tree.bulk_load(entries.begin(), entries.end(), 4));
+    ASSERT_TRUE(!tree.bulk_load(entries.begin(), entries.end(), 4));
+
+    for (uint64_t i = 0; i < kKeys; ++i) {
+        auto res = tree.get(2 * i);
+        ASSERT_TRUE(res.has_value() && *res == i);
+        ASSERT_TRUE(!tree.get(2 * i + 1).has_value());
+    }
+
+    uint64_t expected = 0;
+    tree.scan(0, 2 * kKeys, [&expected](uint64_t key, uint64_t) {
+        ASSERT_TRUE(key == 2 * expected);
+        expected++;
+        return true;
+    });
+    ASSERT_TRUE(expected == kKeys);
+
+    for (uint64_t i = 0; i < kKeys; i += 7) {
+        tree.put(2 * i + 1, i);
+    }
+    for (uint64_t i = 0; i < kKeys; i += 7) {
+        auto res = tree.get(2 * i + 1);
+        ASSERT_TRUE(res.has_value() && *res == i);
+    }
+
+    // Shuffled input with duplicate keys, the last pair of a key wins
+    std::vector<std::pair<uint64_t, uint64_t>> shuffled;
+    for (uint64_t i = 0; i < kKeys; ++i) {
+        shuffled.emplace_back(i % (kKeys / 2), i);
+    }
+    std::shuffle(shuffled.begin(), shuffled.end(), std::mt19937_64(42));
+    std::vector<uint64_t> last_value(kKeys / 2);
+    for (const auto& [key, value] : shuffled) {
+        last_value[key] = value;
+    }
+    Tree unsorted_tree;
+    ASSERT_TRUE(unsorted_tree.bulk_load_unsorted(shuffled.begin(), shuffled.end(), 4));
+    for (uint64_t key = 0; key < kKeys / 2; ++key) {
+        auto res = unsorted_tree.get(key);
+        ASSERT_TRUE(res.has_value() && *res == last_value[key]);
+    }
+
+    std::cout << "BulkLoad test passed.\n";
+}
+
+// Sorted batches merged into a populated tree, compared with std::map
+static void test_merge_sorted() {
+    using Tree = Btree<uint64_t, uint64_t, std::less<uint64_t>, 16>;
+    Tree tree;
+    std::map<uint64_t, uint64_t> reference;
+    std::mt19937_64 rng(7);
+
+    for (uint64_t i = 0; i < 20000; ++i) {
+        uint64_t key = rng() % 100000;
+        tree.put(key, i);
+        reference[key] = i;
+    }
+    for (int round = 0; round < 5; ++round) {
+        std::vector<std::pair<uint64_t, uint64_t>> batch;
+        for (uint64_t i = 0; i < 30000; ++i) {
+            batch.emplace_back(rng() % 200000, round * 100000 + i);
+        }
+        std::stable_sort(batch.begin(), batch.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+        tree.merge_sorted(batch.begin(), batch.end());
+        for (const auto& [key, value] : batch) {
+            reference[key] = value;
+        }
+    }
+
+    auto expected = reference.begin();
+    tree.scan(0, UINT64_MAX, [&](uint64_t key, uint64_t value) {
+        ASSERT_TRUE(expected != reference.end() && expected->first == key && expected->second == value);
+        ++expected;
+        return true;
+    });
+    ASSERT_TRUE(expected == reference.end());
+    for (const auto& [key, value] : reference) {
+        auto res = tree.get(key);
+        ASSERT_TRUE(res.has_value() && *res == value);
+    }
+
+    std::cout << "MergeSorted test passed.\n";
+}
+
+// Cutting a tree in two and joining the halves back, including halves of different height
+static void test_split_concat() {
+    using Tree = Btree<uint64_t, uint64_t, std::less<uint64_t>, 8>;
+    constexpr uint64_t kKeys = 20000;
+    auto count = [](Tree& tree) {
+        uint64_t n = 0;
+        tree.scan(0, UINT64_MAX, [&n](uint64_t, uint64_t) { n++; return true; });
+        return n;
+    };
+
+    for (uint64_t at : {uint64_t{0}, uint64_t{3}, kKeys / 2, kKeys - 5, kKeys + 1}) {
+        Tree tree;
+        for (uint64_t key = 0; key < kKeys; ++key) {
+            tree.put(key, key);
+        }
+        auto right = tree.split_at(at);
+        ASSERT_TRUE(count(tree) == std::min(at, kKeys));
+        ASSERT_TRUE(count(*right) == kKeys - std::min(at, kKeys));
+        ASSERT_TRUE(!tree.get(at).has_value());
+        if (at < kKeys) {
+            ASSERT_TRUE(right->get(at).has_value());
+        }
+
+        ASSERT_TRUE(tree.concat(std::move(*right)));
+        ASSERT_TRUE(count(tree) == kKeys);
+        for (uint64_t key = 0; key < kKeys; ++key) {
+            auto res = tree.get(key);
+            ASSERT_TRUE(res.has_value() && *res == key);
+        }
+        tree.put(kKeys, 0);
+        ASSERT_TRUE(count(tree) == kKeys + 1);
+    }
+
+    Tree low, high;
+    high.put(1, 1);
+    low.put(2, 2);
+    ASSERT_TRUE(!low.concat(std::move(high)));
+
+    // A failed concat changes nothing, not even the empty leaves on the right edge
+    // that a successful one trims, so append hints stay valid
+    Tree left, right;
+    Tree::AppendHint hint;
+    for (uint64_t key = 0; key < 100; ++key) {
+        left.append(key, key, hint);
+    }
+    for (uint64_t key = 50; key < 100; ++key) {
+        left.erase(key);
+    }
+    right.put(10, 10);
+    ASSERT_TRUE(!left.concat(std::move(right)));
+    ASSERT_TRUE(left.append(100, 100, hint));
+    ASSERT_TRUE(count(left) == 51 && right.get(10) == 10);
+
+    std::cout << "SplitConcat test passed.\n";
+}
+
+static void test_snapshot_diff() {
+    using Tree = Btree<uint64_t, uint64_t, std::less<uint64_t>, 8>;
+    constexpr uint64_t kKeys = 20000;
+    Tree tree;
+    for (uint64_t key = 0; key < kKeys; key += 2) {
+        tree.put(key, key);
+    }
+    auto before = tree.snapshot();
+
+    // Writers keep going while the second snapshot is taken
+    std::vector<std::thread> writers;
+    for (uint64_t t = 0; t < 4; t++) {
+        writers.emplace_back([&tree, t] {
+            for (uint64_t key = t * 100; key < t * 100 + 50; key++) {
+                tree.put(key, key + 1);
+            }
+        });
+    }
+    auto during = tree.snapshot();
+    for (auto& writer : writers) {
+        writer.join();
+    }
+    tree.put(kKeys + 1, 0);
+    tree.put(10, 10);
+    auto after = tree.snapshot();
+
+    std::vector<uint64_t> changed;
+    Tree::diff(*before, *after, [&](uint64_t key, const uint64_t* old_value, const uint64_t* new_value) {
+        ASSERT_TRUE(new_value && (!old_value || *old_value != *new_value));
+        changed.push_back(key);
+    });
+    std::vector<uint64_t> expected;
+    for (uint64_t t = 0; t < 4; t++) {
+        for (uint64_t key = t * 100; key < t * 100 + 50; key++) {
+            // Key 10 was put back to its old value
+            if (key != 10) {
+                expected.push_back(key);
+            }
+        }
+    }
+    expected.push_back(kKeys + 1);
+    ASSERT_TRUE(changed == expected);
+
+    // The snapshot taken during the writes may hold any part of them, the diffs
+    // still add up
+    std::map<uint64_t, uint64_t> state;
+    for (uint64_t key = 0; key < kKeys; key += 2) {
+        state[key] = key;
+    }
+    auto apply = [&state](uint64_t key, const uint64_t*, const uint64_t* new_value) { state[key] = *new_value; };
+    Tree::diff(*before, *during, apply);
+    Tree::diff(*during, *after, apply);
+    std::map<uint64_t, uint64_t> final_state;
+    after->scan(0, UINT64_MAX, [&final_state](uint64_t key, uint64_t value) { final_state[key] = value; return true; });
+    ASSERT_TRUE(state == final_state);
+
+    // Across split_at and concat the whole tree is compared
+    auto right = tree.split_at(kKeys / 2);
+    std::size_t removed = 0;
+    auto split = tree.snapshot();
+    Tree::diff(*after, *split, [&removed](uint64_t, const uint64_t* old_value, const uint64_t* new_value) {
+        ASSERT_TRUE(old_value && !new_value);
+        removed++;
+    });
+    ASSERT_TRUE(removed == kKeys / 4 + 1);
+
+    // Snapshots taken while writers put and erase chain up to the final tree
+    auto contents = [](Tree &t) {
+        std::map<uint64_t, uint64_t> entries;
+        t.scan(0, UINT64_MAX, [&entries](uint64_t key, uint64_t value) { entries[key] = value; return true; });
+        return entries;
+    };
+    std::vector<std::unique_ptr<Tree>> chain;
+    chain.push_back(tree.snapshot());
+    std::vector<std::thread> churn;
+    for (uint64_t t = 0; t < 2; t++) {
+        churn.emplace_back([&tree, t] {
+            std::mt19937_64 rng(t);
+            for (int i = 0; i < 20000; i++) {
+                uint64_t key = rng() % kKeys;
+                if (rng() % 3) {
+                    tree.put(key, rng());
+                }
+                else {
+                    tree.erase(key);
+                }
+            }
+        });
+    }
+    for (int i = 0; i < 5; i++) {
+        chain.push_back(tree.snapshot());
+    }
+    for (auto& thread : churn) {
+        thread.join();
+    }
+    chain.push_back(tree.snapshot());
+    std::map<uint64_t, uint64_t> chained = contents(*chain[0]);
+    for (std::size_t i = 1; i < chain.size(); i++) {
+        Tree::diff(*chain[i - 1], *chain[i], [&chained](uint64_t key, const uint64_t*, const uint64_t* new_value) {
+            if (new_value) {
+                chained[key] = *new_value;
+            }
+            else {
+                chained.erase(key);
+            }
+        });
+        ASSERT_TRUE(chained == contents(*chain[i]));
+    }
+    ASSERT_TRUE(chained == contents(tree));
+
+    std::cout << "SnapshotDiff test passed.\n";
+}
+
+// Set operations over multiples of 2 and multiples of 3
+static void test_merge_join() {
+    using Tree = Btree<uint64_t, uint64_t, std::less<uint64_t>, 8>;
+    constexpr uint64_t kLimit = 30000;
+    Tree twos, threes;
+    for (uint64_t key = 0; key < kLimit; key += 2) {
+        twos.put(key, key / 2);
+    }
+    for (uint64_t key = 0; key < kLimit; key += 3) {
+        threes.put(key, key / 3);
+    }
+
+    uint64_t expected = 0;
+    merge_join(twos, threes, [&expected](uint64_t key, uint64_t half, uint64_t third) {
+        ASSERT_TRUE(key == expected && half == key / 2 && third == key / 3);
+        expected += 6;
+    });
+    ASSERT_TRUE(expected == kLimit);
+
+    uint64_t union_count = 0, difference_count = 0;
+    set_union(twos, threes, [&union_count](uint64_t key) {
+        ASSERT_TRUE(key % 2 == 0 || key % 3 == 0);
+        union_count++;
+    });
+    set_difference(twos, threes, [&difference_count](uint64_t key) {
+        ASSERT_TRUE(key % 2 == 0 && key % 3 != 0);
+        difference_count++;
+    });
+    ASSERT_TRUE(union_count == kLimit * 2 / 3);
+    ASSERT_TRUE(difference_count == kLimit / 3);
+
+    std::cout << "MergeJoin test passed.\n";
+}
+
+// Pointer-free key that opts into checkpoints
+struct GridPoint {
+    uint32_t x;
+    uint32_t y;
+};
+
+struct GridPointLess {
+    bool operator()(const GridPoint& a, const GridPoint& b) const {
+        return a.x < b.x || (a.x == b.x && a.y < b.y);
+    }
+};
+
+template<>
+struct checkpoint_as_bytes<GridPoint> : std::true_type {};
+
+// Stream that blocks its first write until released
+struct GatedBuffer : std::stringbuf {
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool entered = false;
+    bool released = false;
+
+    std::streamsize xsputn(const char* data, std::streamsize count) override {
+        std::unique_lock<std::mutex> lock(mutex);
+        entered = true;
+        cv.notify_all();
+        cv.wait(lock, [this] { return released; });
+        lock.unlock();
+        return std::stringbuf::xsputn(data, count);
+    }
+};
+
+static void test_checkpoint() {
+    using Tree = Btree<uint64_t, uint64_t, std::less<uint64_t>, 8>;
+    auto contents = [](Tree& tree) {
+        std::map<uint64_t, uint64_t> entries;
+        tree.scan(0, UINT64_MAX, [&entries](uint64_t key, uint64_t value) { entries[key] = value; return true; });
+        return entries;
+    };
+
+    Tree tree;
+    for (uint64_t key = 0; key < 10000; ++key) {
+        tree.put(key * 2, key);
+    }
+    std::stringstream stream;
+    Checkpointer<Tree> checkpointer(tree);
+    std::size_t base_pages = checkpointer.write(stream);
+
+    // Only the leaves touched since the base are written again
+    for (uint64_t key = 100; key < 110; ++key) {
+        tree.put(key, 7);
+    }
+    std::size_t increment_pages = checkpointer.write(stream);
+    ASSERT_TRUE(increment_pages > 0 && increment_pages * 10 < base_pages);
+    ASSERT_TRUE(checkpointer.write(stream) == 0);
+    tree.put(50001, 1);
+    checkpointer.write(stream);
+
+    Tree recovered;
+    ASSERT_TRUE(recover_checkpoint(stream, recovered));
+    ASSERT_TRUE(contents(recovered) == contents(tree));
+    stream.clear();
+
+    // A torn segment at the end is ignored
+    auto before_tail = contents(tree);
+    tree.put(50003, 1);
+    checkpointer.write(stream);
+    std::string torn = stream.str();
+    torn.resize(torn.size() - 1);
+    std::stringstream torn_stream(torn);
+    Tree partial;
+    ASSERT_TRUE(recover_checkpoint(torn_stream, partial));
+    ASSERT_TRUE(contents(partial) == before_tail);
+
+    // After split_at the next segment is complete again
+    auto right = tree.split_at(5000);
+    checkpointer.write(stream);
+    stream.seekg(0);
+    Tree after_split;
+    ASSERT_TRUE(recover_checkpoint(stream, after_split));
+    ASSERT_TRUE(contents(after_split) == contents(tree));
+    ASSERT_TRUE(!recover_checkpoint(stream, after_split));
+
+    // Any flipped byte is caught by the page checksums
+    const char check[] = "123456789";
+    ASSERT_TRUE(crc32c(0, check, 9) == 0xE3069283u && crc32c_table(0, check, 9) == 0xE3069283u);
+    std::string image = stream.str();
+    for (std::size_t at : {std::size_t{100}, image.size() / 2, image.size() - 100}) {
+        std::string corrupt = image;
+        corrupt[at] ^= 0x10;
+        std::stringstream corrupt_stream(corrupt);
+        Tree rejected;
+        ASSERT_TRUE(!recover_checkpoint(corrupt_stream, rejected));
+    }
+
+    // Writers go on while a chunk of the segment is written to a slow sink, and
+    // chunks copied later hold their writes
+    GatedBuffer gated;
+    std::ostream gated_stream(&gated);
+    Checkpointer<Tree> chunked(tree, 4096);
+    std::thread checkpoint_thread([&] { chunked.write(gated_stream); });
+    {
+        std::unique_lock<std::mutex> lock(gated.mutex);
+        gated.cv.wait(lock, [&gated] { return gated.entered; });
+    }
+    tree.put(60003, 1);
+    {
+        std::lock_guard<std::mutex> lock(gated.mutex);
+        gated.released = true;
+    }
+    gated.cv.notify_all();
+    checkpoint_thread.join();
+    std::stringstream chunked_stream(gated.str());
+    Tree from_chunks;
+    ASSERT_TRUE(recover_checkpoint(chunked_stream, from_chunks));
+    ASSERT_TRUE(contents(from_chunks) == contents(tree));
+
+    // Keys that point elsewhere are refused, pointer-free structs opt in
+    static_assert(!kCheckpointable<byte_array> && !kCheckpointable<const char*>);
+    static_assert(kCheckpointable<uint64_t> && kCheckpointable<GridPoint>);
+    using GridTree = Btree<GridPoint, uint64_t, GridPointLess, 8>;
+    GridTree grid;
+    for (uint32_t x = 0; x < 30; ++x) {
+        grid.put(GridPoint{x, 30 - x}, x);
+    }
+    std::stringstream grid_stream;
+    Checkpointer<GridTree>(grid).write(grid_stream);
+    GridTree grid_recovered;
+    ASSERT_TRUE(recover_checkpoint(grid_stream, grid_recovered));
+    ASSERT_TRUE(grid_recovered.get(GridPoint{7, 23}) == 7);
+
+    std::cout << "Checkpoint test passed.\n";
+}
+
+static void test_fuzzy_checkpoint() {
+    using Tree = Btree<uint64_t, uint64_t, std::less<uint64_t>, 8>;
+    constexpr uint64_t kKeys = 20000;
+    Tree tree;
+    for (uint64_t key = 0; key < kKeys; ++key) {
+        tree.put(key, 0);
+    }
+
+    // A put is logged before it is applied, as with a write-ahead log. The lock
+    // covers both, so a log position read under it covers only applied puts.
+    std::mutex log_mutex;
+    std::vector<std::pair<uint64_t, uint64_t>> log;
+    auto logged_put = [&](uint64_t key, uint64_t value) {
+        std::lock_guard<std::mutex> lock(log_mutex);
+        log.emplace_back(key, value);
+        tree.put(key, value);
+    };
+
+    std::atomic<bool> done{false};
+    std::thread writer([&] {
+        for (uint64_t i = 1; !done.load(); i++) {
+            logged_put(i * 7919 % (kKeys * 2), i);
+        }
+    });
+    uint64_t log_position;
+    {
+        std::lock_guard<std::mutex> lock(log_mutex);
+        log_position = log.size();
+    }
+    std::stringstream stream;
+    // Paced to take at least 20 ms
+    uint64_t image_bytes = kKeys * 2 * sizeof(uint64_t);
+    FuzzyCheckpointer<Tree> checkpointer(tree, image_bytes * 50);
+    auto start = std::chrono::steady_clock::now();
+    ASSERT_TRUE(checkpointer.write(stream, log_position) > 0);
+    ASSERT_TRUE(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(20));
+    done = true;
+    writer.join();
+
+    Tree recovered;
+    uint64_t replay_from = 0;
+    ASSERT_TRUE(recover_checkpoint(stream, recovered, &replay_from));
+    ASSERT_TRUE(replay_from == log_position);
+    for (std::size_t i = replay_from; i < log.size(); i++) {
+        recovered.put(log[i].first, log[i].second);
+    }
+    for (uint64_t key = 0; key < kKeys * 2; ++key) {
+        ASSERT_TRUE(recovered.get(key) == tree.get(key));
+    }
+
+    std::cout << "FuzzyCheckpoint test passed.\n";
+}
+
+static void test_transactions() {
+    using Tree = Btree<uint64_t, uint64_t, std::less<uint64_t>, 8>;
+    constexpr uint64_t kAccounts = 200;
+    constexpr uint64_t kBalance = 1000;
+    Tree tree;
+    for (uint64_t key = 0; key < kAccounts; ++key) {
+        tree.put(key * 10, kBalance);
+    }
+
+    // A write to a key read by a transaction makes it fail
+    auto stale = tree.transaction();
+    ASSERT_TRUE(stale.get(0) == kBalance);
+    stale.put(10, 0);
+    tree.put(0, kBalance);
+    ASSERT_TRUE(!stale.commit());
+    ASSERT_TRUE(tree.get(10) == kBalance);
+
+    // Transfers between random accounts keep the total, plain puts go on alongside
+    std::vector<std::thread> threads;
+    std::atomic<uint64_t> commits{0};
+    for (unsigned t = 0; t < 4; t++) {
+        threads.emplace_back([&tree, &commits, t] {
+            std::mt19937_64 rng(t);
+            while (commits.load() < 2000) {
+                uint64_t from = rng() % kAccounts * 10;
+                uint64_t to = rng() % kAccounts * 10;
+                if (from == to) {
+                    continue;
+                }
+                auto txn = tree.transaction();
+                uint64_t amount = rng() % 10;
+                uint64_t from_balance = *txn.get(from);
+                if (from_balance < amount) {
+                    continue;
+                }
+                txn.put(from, from_balance - amount);
+                txn.put(to, *txn.get(to) + amount);
+                if (txn.commit()) {
+                    commits++;
+                }
+            }
+        });
+    }
+    threads.emplace_back([&tree] {
+        for (uint64_t key = 0; key < 5000; ++key) {
+            tree.put(key * 10 + 5, key);
+        }
+    });
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    uint64_t total = 0;
+    for (uint64_t key = 0; key < kAccounts; ++key) {
+        total += *tree.get(key * 10);
+    }
+    ASSERT_TRUE(total == kAccounts * kBalance);
+
+    // The largest transaction lands in a single gap between keys
+    auto wide = tree.transaction();
+    for (uint64_t i = 0; i < Tree::kMaxTransactionWrites; ++i) {
+        wide.put(100000 + i, i);
+    }
+    ASSERT_TRUE(wide.commit());
+    for (uint64_t i = 0; i < Tree::kMaxTransactionWrites; ++i) {
+        ASSERT_TRUE(tree.get(100000 + i) == i);
+    }
+
+    std::cout << "Transactions test passed.\n";
+}
+
+static void test_range_locks() {
+    using Tree = Btree<uint64_t, uint64_t, std::less<uint64_t>, 8>;
+    Tree tree;
+    for (uint64_t key = 0; key < 100; ++key) {
+        tree.put(key * 10, key);
+    }
+
+    // A scan locks its range: an insert into it waits for the commit, so a second
+    // scan in the same transaction sees no phantom
+    auto txn = tree.transaction();
+    uint64_t first_count = 0;
+    ASSERT_TRUE(txn.scan(100, 200, [&](const uint64_t &, const uint64_t &) { first_count++; return true; }));
+    ASSERT_TRUE(tree.try_put(155, 1) == OpStatus::Busy);
+    ASSERT_TRUE(tree.put_until(155, 1, std::chrono::steady_clock::now() + std::chrono::milliseconds(5)) ==
+                OpStatus::Busy);
+    ASSERT_TRUE(tree.try_put(255, 1) == OpStatus::Ok);
+    std::atomic<bool> inserted{false};
+    std::thread writer([&] {
+        tree.put(155, 1);
+        inserted = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    uint64_t second_count = 0;
+    ASSERT_TRUE(txn.scan(100, 200, [&](const uint64_t &, const uint64_t &) { second_count++; return true; }));
+    ASSERT_TRUE(first_count == 11 && second_count == 11 && !inserted);
+
+    // Another transaction cannot lock an overlapping range or write into it
+    auto other = tree.transaction();
+    ASSERT_TRUE(!other.lock_range(200, 300));
+    ASSERT_TRUE(other.lock_range(201, 300));
+    other.put(150, 0);
+    ASSERT_TRUE(!other.commit());
+
+    // The owner writes into its range and the waiting insert follows the commit
+    txn.put(150, 0);
+    ASSERT_TRUE(txn.commit());
+    writer.join();
+    ASSERT_TRUE(inserted && tree.get(150) == 0 && tree.get(155) == 1);
+    ASSERT_TRUE(tree.range_locks.empty());
+
+    // Destroying a transaction releases its ranges
+    {
+        auto dropped = tree.transaction();
+        ASSERT_TRUE(dropped.lock_range(0, 1000));
+    }
+    ASSERT_TRUE(tree.try_put(5, 1) == OpStatus::Ok);
+
+    std::cout << "Range locks test passed.\n";
+}
+
+static void test_key_encoding() {
+    using Clock = std::chrono::system_clock;
+    using Row = std::tuple<int32_t, std::string, Clock::time_point, std::optional<int64_t>>;
+    const Clock::time_point epoch{};
+    std::vector<Row> rows;
+    for (int32_t a : {-70000, -1, 0, 1, 300}) {
+        for (std::string b : {std::string(""), std::string("a"), std::string("a\0", 2), std::string("a\0b", 3),
+                              std::string("ab"), std::string("b")}) {
+            for (int64_t c : {-5, 0, 7}) {
+                rows.emplace_back(a, b, epoch + std::chrono::seconds(c), c == 0 ? std::nullopt : std::optional(c));
+            }
+        }
+    }
+
+    // Memcmp order of the keys matches the order of the fields: a ascending, b and
+    // c descending, d ascending with nulls last
+    auto field_less = [](const Row &x, const Row &y) {
+        if (std::get<0>(x) != std::get<0>(y)) return std::get<0>(x) < std::get<0>(y);
+        if (std::get<1>(x) != std::get<1>(y)) return std::get<1>(x) > std::get<1>(y);
+        if (std::get<2>(x) != std::get<2>(y)) return std::get<2>(x) > std::get<2>(y);
+        return std::get<3>(x).has_value() && (!std::get<3>(y) || *std::get<3>(x) < *std::get<3>(y));
+    };
+    std::vector<std::vector<unsigned char>> buffers;
+    std::vector<byte_array> keys;
+    for (const Row &row : rows) {
+        buffers.emplace_back(64);
+        KeyEncoder encoder(buffers.back().data(), buffers.back().size());
+        encoder.add(std::get<0>(row))
+            .add(descending(std::get<1>(row)))
+            .add(descending(std::get<2>(row)))
+            .add(std::get<3>(row), KeyOrder::Ascending, NullOrder::Last);
+        ASSERT_TRUE(encoder.fits());
+        keys.push_back(encoder.key());
+    }
+    for (std::size_t i = 0; i < rows.size(); ++i) {
+        for (std::size_t j = 0; j < rows.size(); ++j) {
+            ASSERT_TRUE(less_bytes{}(keys[i], keys[j]) == field_less(rows[i], rows[j]));
+        }
+    }
+
+    // The keys index a tree, scans come out in field order
+    Btree<byte_array, uint64_t, less_bytes, 8> tree;
+    for (std::size_t i = 0; i < keys.size(); ++i) {
+        tree.put(keys[i], i);
+    }
+    std::vector<Row> scanned;
+    for (auto cursor = tree.cursor(); cursor.valid(); cursor.next()) {
+        scanned.push_back(rows[cursor.value()]);
+    }
+    ASSERT_TRUE(scanned.size() == rows.size() && std::is_sorted(scanned.begin(), scanned.end(), field_less));
+
+    // A key that does not fit reports the size it needs
+    unsigned char small[6];
+    KeyEncoder encoder(small, sizeof(small));
+    encoder.add(uint32_t{1}).add("abc");
+    ASSERT_TRUE(!encoder.fits() && encoder.size == 9 && encoder.key().size == 0);
+    ASSERT_TRUE(!encode_key(small, sizeof(small), int64_t{1}).has_value());
+    auto key = encode_key(small, sizeof(small), int16_t{-2}, descending(uint8_t{3}));
+    ASSERT_TRUE(key && key->size == 3 && small[0] == 0x7F && small[1] == 0xFE && small[2] == 0xFC);
+
+    std::cout << "Key encoding test passed.\n";
+}
+
+struct Account {
+    uint32_t city;
+    uint32_t age;
+    uint64_t balance;
+};
+
+struct ByCity {
+    using Key = uint32_t;
+    using Comparator = std::less<uint32_t>;
+    using Covered = uint64_t;
+    static Key key(const Account &account) { return account.city; }
+    static Covered cover(const Account &account) { return account.balance; }
+};
+
+struct ByAge {
+    using Key = uint32_t;
+    using Comparator = std::less<uint32_t>;
+    static Key key(const Account &account) { return account.age; }
+};
+
+static void test_indexed_table() {
+    IndexedTable<uint64_t, Account, std::less<uint64_t>, 8, ByCity, ByAge> table;
+    std::map<uint64_t, Account> reference;
+    std::mt19937_64 rng(94);
+
+    // Single changes and batches with repeated keys
+    for (int round = 0; round < 200; ++round) {
+        decltype(table)::Batch batch;
+        int changes = round % 4 == 0 ? 1 : 20;
+        for (int i = 0; i < changes; ++i) {
+            uint64_t id = rng() % 300;
+            if (rng() % 4 == 0) {
+                batch.erase(id);
+                reference.erase(id);
+            }
+            else {
+                Account account{static_cast<uint32_t>(rng() % 10), static_cast<uint32_t>(rng() % 50), rng() % 1000};
+                batch.put(id, account);
+                reference[id] = account;
+            }
+        }
+        table.commit(batch);
+        ASSERT_TRUE(batch.changes.empty());
+    }
+    table.put(1000, Account{3, 30, 7});
+    reference[1000] = Account{3, 30, 7};
+    table.erase(1000);
+    reference.erase(1000);
+
+    // Each index holds exactly one entry per row, in (index key, id) order
+    std::vector<std::pair<uint32_t, uint64_t>> expected;
+    for (const auto &[id, account] : reference) {
+        expected.emplace_back(account.city, id);
+    }
+    std::sort(expected.begin(), expected.end());
+    std::vector<std::pair<uint32_t, uint64_t>> by_city;
+    table.scan_index<0>(0, 9, [&](uint32_t city, uint64_t id, uint64_t balance) {
+        ASSERT_TRUE(reference.at(id).balance == balance);
+        by_city.emplace_back(city, id);
+        return true;
+    });
+    ASSERT_TRUE(by_city == expected);
+
+    std::size_t middle_aged = 0;
+    table.scan_index<1>(20, 29, [&](uint32_t age, uint64_t id, NoColumns) {
+        ASSERT_TRUE(age >= 20 && age <= 29 && reference.at(id).age == age);
+        middle_aged++;
+        return true;
+    });
+    ASSERT_TRUE(middle_aged == static_cast<std::size_t>(std::count_if(reference.begin(), reference.end(),
+        [](const auto &entry) { return entry.second.age >= 20 && entry.second.age <= 29; })));
+    for (const auto &[id, account] : reference) {
+        ASSERT_TRUE(table.get(id)->balance == account.balance);
+    }
+
+    std::cout << "Indexed table test passed.\n";
+}
+
+static void test_time_series_append() {
+    using Tree = Btree<uint64_t, uint64_t, std::less<uint64_t>, 16>;
+    constexpr uint64_t kSeries = 32;
+    constexpr uint64_t kPoints = 2000;
+    auto series_of = [](uint64_t key) { return key >> 40; };
+    auto point = [](uint64_t series, uint64_t time) { return series << 40 | time; };
+
+    // Interleaved series, most appends skip the descent
+    Tree tree;
+    TimeSeriesAppender<Tree, decltype(series_of)> appender(tree, series_of);
+    Checkpointer<Tree> checkpointer(tree);
+    std::stringstream stream;
+    for (uint64_t time = 0; time < kPoints; ++time) {
+        for (uint64_t series = 0; series < kSeries; ++series) {
+            appender.append(point(series, time * 3), time);
+        }
+        // Checkpoints in between send every series back through the descent once
+        if (time % 500 == 0) {
+            checkpointer.write(stream);
+        }
+    }
+    checkpointer.write(stream);
+    ASSERT_TRUE(appender.appends == kSeries * kPoints && appender.hits > appender.appends * 3 / 4);
+
+    std::size_t count = 0;
+    uint64_t previous = 0;
+    for (auto cursor = tree.cursor(); cursor.valid(); cursor.next(), ++count) {
+        ASSERT_TRUE(count == 0 || previous < cursor.key());
+        ASSERT_TRUE(cursor.value() == (cursor.key() & 0xFFFFFFFFFF) / 3);
+        previous = cursor.key();
+    }
+    ASSERT_TRUE(count == kSeries * kPoints);
+    ASSERT_TRUE(tree.get(point(7, 300)) == 100);
+
+    // Incremental checkpoints see the leaves written by appends
+    Tree recovered;
+    ASSERT_TRUE(recover_checkpoint(stream, recovered));
+    auto a = tree.cursor();
+    auto b = recovered.cursor();
+    for (; a.valid() && b.valid(); a.next(), b.next()) {
+        ASSERT_TRUE(a.key() == b.key() && a.value() == b.value());
+    }
+    ASSERT_TRUE(!a.valid() && !b.valid());
+
+    // Threads appending to their own series, with puts into the same key space
+    Tree shared;
+    std::vector<std::thread> threads;
+    for (uint64_t t = 0; t < 4; t++) {
+        threads.emplace_back([&, t] {
+            TimeSeriesAppender<Tree, decltype(series_of)> own(shared, series_of);
+            for (uint64_t time = 1; time <= kPoints; ++time) {
+                for (uint64_t series = t * 8; series < t * 8 + 8; ++series) {
+                    own.append(point(series, time), time);
+                }
+                if (time % 100 == 0) {
+                    shared.put(point(t * 8, 0), time);
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    count = 0;
+    for (auto cursor = shared.cursor(); cursor.valid(); cursor.next()) {
+        count++;
+    }
+    ASSERT_TRUE(count == kSeries * kPoints + 4);
+
+    std::cout << "Time series append test passed.\n";
+}
+
+static void test_rollup() {
+    using Tree = Btree<uint64_t, uint64_t, std::less<uint64_t>, 16>;
+    auto point = [](uint64_t series, uint64_t second) { return series << 40 | second; };
+    Tree tree;
+    std::map<std::pair<uint64_t, uint64_t>, std::pair<uint64_t, uint64_t>> expected;
+    std::mt19937_64 rng(96);
+    for (uint64_t series = 0; series < 4; ++series) {
+        for (uint64_t second = 0; second < 3600; second += 1 + rng() % 7) {
+            uint64_t value = rng() % 100;
+            tree.put(point(series, second), value);
+            if (series >= 1 && series <= 2) {
+                auto &bucket = expected[{series, second / 60}];
+                bucket.first++;
+                bucket.second += value;
+            }
+        }
+    }
+
+    // Count and sum per series and minute, for series 1 and 2
+    struct Stats {
+        uint64_t count;
+        uint64_t sum;
+    };
+    auto minute_of = [](uint64_t key) { return std::make_pair(key >> 40, (key & 0xFFFFFFFFFF) / 60); };
+    auto add = [](Stats &stats, uint64_t, uint64_t value) {
+        stats.count++;
+        stats.sum += value;
+    };
+    std::vector<std::pair<std::pair<uint64_t, uint64_t>, Stats>> rows;
+    rollup(tree, point(1, 0), point(2, 3599), minute_of, Stats{0, 0}, add,
+           [&](const std::pair<uint64_t, uint64_t> &minute, const Stats &stats) {
+               rows.emplace_back(minute, stats);
+               return true;
+           });
+    ASSERT_TRUE(rows.size() == expected.size() && rows.size() == 120);
+    auto it = expected.begin();
+    for (const auto &[minute, stats] : rows) {
+        ASSERT_TRUE(minute == it->first && stats.count == it->second.first && stats.sum == it->second.second);
+        ++it;
+    }
+
+    // emit can stop the scan
+    std::size_t emitted = 0;
+    rollup(tree, point(0, 0), point(3, 3599), minute_of, Stats{0, 0}, add,
+           [&](const std::pair<uint64_t, uint64_t> &, const Stats &) { return ++emitted < 5; });
+    ASSERT_TRUE(emitted == 5);
+
+    std::cout << "Rollup test passed.\n";
+}
+
+static void test_sample_and_approx_count() {
+    using Tree = Btree<uint64_t, uint64_t, std::less<uint64_t>, 16>;
+    constexpr uint64_t kKeys = 100000;
+    std::vector<uint64_t> keys(kKeys);
+    for (uint64_t i = 0; i < kKeys; ++i) {
+        keys[i] = 2 * i;
+    }
+    std::mt19937_64 rng(97);
+    std::shuffle(keys.begin(), keys.end(), rng);
+    Tree tree;
+    for (uint64_t key : keys) {
+        tree.put(key, key + 1);
+    }
+
+    // Close for wide ranges, exact within a leaf
+    std::size_t estimate = tree.approx_count(20000, 139999);
+    ASSERT_TRUE(estimate > 60000 * 3 / 4 && estimate < 60000 * 5 / 4);
+    ASSERT_TRUE(tree.approx_count(101, 109) == 4);
+    ASSERT_TRUE(tree.approx_count(10, 5) == 0);
+
+    // Draws stay in range and spread evenly over it
+    auto entries = tree.sample(20000, 139999, 10000, rng);
+    ASSERT_TRUE(entries.size() == 10000);
+    std::vector<std::size_t> buckets(6);
+    for (const auto &[key, value] : entries) {
+        ASSERT_TRUE(key >= 20000 && key <= 139999 && value == key + 1);
+        buckets[(key - 20000) / 20000]++;
+    }
+    for (std::size_t count : buckets) {
+        ASSERT_TRUE(count > 10000 / 6 * 4 / 5 && count < 10000 / 6 * 6 / 5);
+    }
+    ASSERT_TRUE(tree.sample(300001, 400000, 10, rng).empty());
+
+    std::cout << "Sample and approx count test passed.\n";
+}
+
+static void test_histogram() {
+    using Tree = Btree<uint64_t, uint64_t, std::less<uint64_t>, 8>;
+    Tree tree;
+    std::mt19937_64 rng(98);
+    for (uint64_t i = 0; i < 20000; ++i) {
+        tree.put(rng() % 1000000, i);
+    }
+    std::size_t exact = 0;
+    tree.scan(0, UINT64_MAX, [&](const uint64_t &, const uint64_t &) { exact++; return true; });
+
+    // Buckets hold similar counts that add up to about the tree size
+    EquiDepthHistogram<Tree> histogram(tree, 10);
+    std::size_t parents = histogram.refresh();
+    ASSERT_TRUE(histogram.buckets.size() == 10 && histogram.total() > exact * 3 / 4 && histogram.total() < exact * 5 / 4);
+    for (const auto &bucket : histogram.buckets) {
+        ASSERT_TRUE(bucket.count > histogram.total() / 20 && bucket.count < histogram.total() / 5);
+    }
+    std::size_t estimate = histogram.estimate(200000, 599999);
+    ASSERT_TRUE(estimate > exact * 4 / 10 * 2 / 3 && estimate < exact * 4 / 10 * 4 / 3);
+
+    // Puts into one region: the refresh revisits only the parents there and ends
+    // where a rebuild would
+    std::size_t region_before = histogram.estimate(900000, 999999);
+    for (uint64_t i = 0; i < 5000; ++i) {
+        tree.put(900000 + rng() % 100000, i);
+    }
+    std::size_t revisited = histogram.refresh();
+    ASSERT_TRUE(revisited > 0 && revisited < parents / 2);
+    EquiDepthHistogram<Tree> rebuilt(tree, 10);
+    rebuilt.refresh();
+    ASSERT_TRUE(histogram.spans.size() == rebuilt.spans.size());
+    for (std::size_t i = 0; i < rebuilt.spans.size(); ++i) {
+        ASSERT_TRUE(histogram.spans[i].hi == rebuilt.spans[i].hi && histogram.spans[i].count == rebuilt.spans[i].count);
+    }
+    ASSERT_TRUE(histogram.estimate(900000, 999999) > region_before + 2500);
+    ASSERT_TRUE(histogram.refresh() == 0);
+
+    std::cout << "Histogram test passed.\n";
+}
+
+int main() {
+    test_multithread_writers<std::shared_mutex>();
+    test_multithread_writers<WriterPreferringLatch>();
+    test_multithread_writers<PhaseFairLatch>();
+    test_deferred_splits();
+    test_try_operations();
+    test_async_api();
+    test_bulk_load();
+    test_merge_sorted();
+    test_split_concat();
+    test_merge_join();
+    test_snapshot_diff();
+    test_checkpoint();
+    test_fuzzy_checkpoint();
+    test_transactions();
+    test_range_locks();
+    test_key_encoding();
+    test_indexed_table();
+    test_time_series_append();
+    test_rollup();
+    test_sample_and_approx_count();
+    test_histogram();
+}
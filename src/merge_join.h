@@ -0,0 +1,73 @@
+#pragma once
+
+// Ordered merge joins and set operations over the keys of two trees with the same
+// key type and comparator. Both trees are walked in lockstep with cursors; the
+// side that is behind seeks to the key of the other side, which stays within the
+// buffered leaf for short gaps and descends from the root for long ones. The
+// trees may change meanwhile, the result then reflects no single point in time.
+
+// Calls fn(key, value_a, value_b) for every key present in both trees, in key order
+template<typename TreeA, typename TreeB, typename Fn>
+void merge_join(TreeA &a, TreeB &b, Fn &&fn) {
+    const typename TreeA::Comparator comparator{};
+    auto ca = a.cursor();
+    auto cb = b.cursor();
+    while (ca.valid() && cb.valid()) {
+        if (comparator(ca.key(), cb.key())) {
+            ca.seek(cb.key());
+        }
+        else if (comparator(cb.key(), ca.key())) {
+            cb.seek(ca.key());
+        }
+        else {
+            fn(ca.key(), ca.value(), cb.value());
+            ca.next();
+            cb.next();
+        }
+    }
+}
+
+// Calls fn(key) for every key present in both trees, in key order
+template<typename TreeA, typename TreeB, typename Fn>
+void set_intersection(TreeA &a, TreeB &b, Fn &&fn) {
+    merge_join(a, b, [&fn](const auto &key, const auto &, const auto &) { fn(key); });
+}
+
+// Calls fn(key) once for every key present in either tree, in key order
+template<typename TreeA, typename TreeB, typename Fn>
+void set_union(TreeA &a, TreeB &b, Fn &&fn) {
+    const typename TreeA::Comparator comparator{};
+    auto ca = a.cursor();
+    auto cb = b.cursor();
+    while (ca.valid() || cb.valid()) {
+        if (!cb.valid() || (ca.valid() && comparator(ca.key(), cb.key()))) {
+            fn(ca.key());
+            ca.next();
+        }
+        else if (!ca.valid() || comparator(cb.key(), ca.key())) {
+            fn(cb.key());
+            cb.next();
+        }
+        else {
+            fn(ca.key());
+            ca.next();
+            cb.next();
+        }
+    }
+}
+
+// Calls fn(key) for every key of a that is not in b, in key order
+template<typename TreeA, typename TreeB, typename Fn>
+void set_difference(TreeA &a, TreeB &b, Fn &&fn) {
+    const typename TreeA::Comparator comparator{};
+    auto ca = a.cursor();
+    auto cb = b.cursor();
+    for (; ca.valid(); ca.next()) {
+        if (cb.valid() && comparator(cb.key(), ca.key())) {
+            cb.seek(ca.key());
+        }
+        if (!cb.valid() || comparator(ca.key(), cb.key())) {
+            fn(ca.key());
+        }
+    }
+}
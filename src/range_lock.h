@@ -0,0 +1,79 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+// Key ranges locked by transactions. Few ranges are held at a time, so they are
+// kept in a plain list. count lets writers skip the table while it is empty.
+template<typename KeyT, typename ComparatorT>
+struct RangeLockTable {
+    // The keys lo <= key <= hi, held by a transaction
+    struct Range {
+        KeyT lo;
+        KeyT hi;
+        const void* owner;
+    };
+
+    std::mutex mutex;
+    std::condition_variable released;
+    std::vector<Range> ranges;
+    std::atomic<std::size_t> count{0};
+
+    bool empty() const {
+        return count.load(std::memory_order_relaxed) == 0;
+    }
+
+    // Whether an owner other than owner holds a range overlapping [lo, hi]
+    bool conflicts(const KeyT &lo, const KeyT &hi, const void* owner) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return conflicts_locked(lo, hi, owner);
+    }
+
+    // Lock [lo, hi] unless it overlaps a range of another owner
+    bool try_lock(const KeyT &lo, const KeyT &hi, const void* owner) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (conflicts_locked(lo, hi, owner)) {
+            return false;
+        }
+        ranges.push_back({lo, hi, owner});
+        count.store(ranges.size(), std::memory_order_relaxed);
+        return true;
+    }
+
+    void unlock_all(const void* owner) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ranges.erase(std::remove_if(ranges.begin(), ranges.end(),
+                                        [owner](const Range &range) { return range.owner == owner; }),
+                         ranges.end());
+            count.store(ranges.size(), std::memory_order_relaxed);
+        }
+        released.notify_all();
+    }
+
+    // Block until no range holds key
+    void wait_unlocked(const KeyT &key) {
+        std::unique_lock<std::mutex> lock(mutex);
+        released.wait(lock, [&] { return !conflicts_locked(key, key, nullptr); });
+    }
+
+    // Same, gives up at the deadline
+    bool wait_unlocked_until(const KeyT &key, std::chrono::steady_clock::time_point deadline) {
+        std::unique_lock<std::mutex> lock(mutex);
+        return released.wait_until(lock, deadline, [&] { return !conflicts_locked(key, key, nullptr); });
+    }
+
+private:
+    bool conflicts_locked(const KeyT &lo, const KeyT &hi, const void* owner) const {
+        const ComparatorT comparator{};
+        for (const Range &range : ranges) {
+            if (range.owner != owner && !comparator(hi, range.lo) && !comparator(range.hi, lo)) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
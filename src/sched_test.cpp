@@ -0,0 +1,249 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include "btree.h"
+#include "scheduler.h"
+
+// Explores interleavings of concurrent tree operations, one seeded schedule per
+// run. Every latch acquire and release is a switch point. Usage:
+//
+//   btree_sched [first_seed [count]]
+//
+// A failing seed is printed and replays alone with btree_sched <seed> 1.
+
+using SchedTree = Btree<uint64_t, uint64_t, std::less<uint64_t>, 4, ScheduledLatch>;
+
+// Enough for the scenarios below, which finish in a few thousand steps
+static constexpr uint64_t kMaxSteps = 1000000;
+
+// Failures seen by the threads of the current run
+static std::vector<std::string> failures;
+
+#define SCHED_CHECK(cond) \
+    do { if (!(cond)) failures.push_back("line " + std::to_string(__LINE__) + ": " #cond); } while (0)
+
+// The tree holds exactly the model's entries, in order, by scan, cursor and get
+static void check_contents(SchedTree &tree, const std::map<uint64_t, uint64_t> &model) {
+    std::vector<std::pair<uint64_t, uint64_t>> scanned;
+    tree.scan(0, UINT64_MAX, [&scanned](const uint64_t &key, const uint64_t &value) {
+        scanned.emplace_back(key, value);
+        return true;
+    });
+    std::vector<std::pair<uint64_t, uint64_t>> expected(model.begin(), model.end());
+    SCHED_CHECK(scanned == expected);
+
+    std::vector<std::pair<uint64_t, uint64_t>> iterated;
+    SchedTree::Cursor cursor(&tree);
+    for (cursor.seek(0); cursor.valid(); cursor.next()) {
+        iterated.emplace_back(cursor.key(), cursor.value());
+    }
+    SCHED_CHECK(iterated == scanned);
+
+    for (const auto &[key, value] : model) {
+        SCHED_CHECK(tree.get(key) == value);
+    }
+}
+
+// Readers look up keys that are in the tree before the run and stay there, while a
+// writer grows the tree from a full root leaf, so the first puts replace the root
+// under the readers.
+static void root_split_vs_readers(uint64_t seed) {
+    SchedTree tree;
+    std::map<uint64_t, uint64_t> model;
+    const std::vector<uint64_t> stable = {100, 200, 300, 400};
+    for (uint64_t key : stable) {
+        tree.put(key, key);
+        model[key] = key;
+    }
+
+    std::mt19937_64 rng(seed);
+    std::vector<uint64_t> added;
+    for (uint64_t key = 50; key < 450; key += 25) {
+        if (key % 100 != 0) {
+            added.push_back(key);
+        }
+    }
+    std::shuffle(added.begin(), added.end(), rng);
+
+    DeterministicScheduler scheduler(seed, kMaxSteps);
+    scheduler.run({
+        [&] {
+            for (uint64_t key : added) {
+                tree.put(key, key);
+            }
+        },
+        [&] {
+            for (int round = 0; round < 4; round++) {
+                for (uint64_t key : stable) {
+                    SCHED_CHECK(tree.get(key) == key);
+                }
+            }
+        },
+        [&] {
+            for (int round = 0; round < 2; round++) {
+                std::vector<uint64_t> seen;
+                tree.scan(0, UINT64_MAX, [&seen](const uint64_t &key, const uint64_t &) {
+                    seen.push_back(key);
+                    return true;
+                });
+                SCHED_CHECK(std::is_sorted(seen.begin(), seen.end()));
+                SCHED_CHECK(std::adjacent_find(seen.begin(), seen.end()) == seen.end());
+                for (uint64_t key : stable) {
+                    SCHED_CHECK(std::count(seen.begin(), seen.end(), key) == 1);
+                }
+            }
+        },
+    });
+
+    for (uint64_t key : added) {
+        model[key] = key;
+    }
+    check_contents(tree, model);
+}
+
+// Two writers put and erase disjoint keys deep enough to split the inner root,
+// while a cursor walks the stable keys
+static void writers_vs_cursor(uint64_t seed) {
+    SchedTree tree;
+    std::map<uint64_t, uint64_t> model;
+    const std::vector<uint64_t> stable = {1005, 2005, 3005};
+    for (uint64_t key : stable) {
+        tree.put(key, key);
+        model[key] = key;
+    }
+
+    std::mt19937_64 rng(seed ^ 0x9E3779B97F4A7C15ull);
+    std::vector<uint64_t> even, odd;
+    for (uint64_t key = 10; key < 4000; key += 130) {
+        (key / 130 % 2 ? odd : even).push_back(key);
+    }
+    std::shuffle(even.begin(), even.end(), rng);
+    std::shuffle(odd.begin(), odd.end(), rng);
+
+    auto writer = [&tree](const std::vector<uint64_t> &keys) {
+        for (uint64_t key : keys) {
+            tree.put(key, key + 1);
+        }
+        // Erase every third key again
+        for (std::size_t i = 0; i < keys.size(); i += 3) {
+            SCHED_CHECK(tree.erase(keys[i]));
+        }
+    };
+
+    DeterministicScheduler scheduler(seed, kMaxSteps);
+    scheduler.run({
+        [&] { writer(even); },
+        [&] { writer(odd); },
+        [&] {
+            SchedTree::Cursor cursor(&tree);
+            std::vector<uint64_t> seen;
+            for (cursor.seek(0); cursor.valid(); cursor.next()) {
+                seen.push_back(cursor.key());
+            }
+            SCHED_CHECK(std::is_sorted(seen.begin(), seen.end()));
+            for (uint64_t key : stable) {
+                SCHED_CHECK(std::count(seen.begin(), seen.end(), key) == 1);
+            }
+        },
+    });
+
+    for (const std::vector<uint64_t> *keys : {&even, &odd}) {
+        for (std::size_t i = 0; i < keys->size(); i++) {
+            if (i % 3 != 0) {
+                model[(*keys)[i]] = (*keys)[i] + 1;
+            }
+        }
+    }
+    check_contents(tree, model);
+}
+
+// Two threads move amounts between overlapping accounts with transactions, retrying
+// until they commit, while a writer splits the leaves around them
+static void transfers_vs_writer(uint64_t seed) {
+    SchedTree tree;
+    std::map<uint64_t, uint64_t> model;
+    const std::vector<uint64_t> accounts = {100, 200, 300, 400};
+    for (uint64_t key : accounts) {
+        tree.put(key, 100);
+        model[key] = 100;
+    }
+
+    std::mt19937_64 rng(seed ^ 0xC2B2AE3D27D4EB4Full);
+    std::vector<uint64_t> added;
+    for (uint64_t key = 50; key < 450; key += 25) {
+        if (key % 100 != 0) {
+            added.push_back(key);
+        }
+    }
+    std::shuffle(added.begin(), added.end(), rng);
+
+    auto transfer = [&tree](uint64_t from, uint64_t to) {
+        while (true) {
+            auto txn = tree.transaction();
+            uint64_t from_balance = *txn.get(from);
+            txn.put(from, from_balance - 10);
+            txn.put(to, *txn.get(to) + 10);
+            if (txn.commit()) {
+                return;
+            }
+        }
+    };
+
+    DeterministicScheduler scheduler(seed, kMaxSteps);
+    scheduler.run({
+        [&] {
+            for (int round = 0; round < 3; round++) {
+                transfer(100, 400);
+            }
+        },
+        [&] {
+            for (int round = 0; round < 3; round++) {
+                transfer(400, 200);
+            }
+        },
+        [&] {
+            for (uint64_t key : added) {
+                tree.put(key, key);
+            }
+        },
+    });
+
+    model[100] = 70;
+    model[200] = 130;
+    for (uint64_t key : added) {
+        model[key] = key;
+    }
+    check_contents(tree, model);
+}
+
+int main(int argc, char** argv) {
+    uint64_t first_seed = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1;
+    uint64_t count = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 2000;
+
+    const std::pair<const char*, void (*)(uint64_t)> scenarios[] = {
+        {"root_split_vs_readers", root_split_vs_readers},
+        {"writers_vs_cursor", writers_vs_cursor},
+        {"transfers_vs_writer", transfers_vs_writer},
+    };
+    for (const auto &[name, scenario] : scenarios) {
+        for (uint64_t seed = first_seed; seed < first_seed + count; seed++) {
+            scenario(seed);
+            if (!failures.empty()) {
+                std::cerr << name << " failed with seed " << seed << ":\n";
+                for (const std::string &failure : failures) {
+                    std::cerr << "  " << failure << "\n";
+                }
+                std::cerr << "Replay with: btree_sched " << seed << " 1\n";
+                return 1;
+            }
+        }
+        std::cout << name << ": " << count << " schedules passed." << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,165 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+// Deterministic interleaving of test threads. Threads run one at a time and hand
+// over at yield points, the next one picked by a generator seeded per run, so a
+// seed replays the same interleaving. ScheduledLatch yields at every acquire and
+// release; as the LatchT of a Btree it puts a yield point at each latch operation.
+
+class DeterministicScheduler {
+public:
+    // Constructor
+    DeterministicScheduler(uint64_t seed, uint64_t max_steps) : seed(seed), rng(seed), max_steps(max_steps) {}
+
+    // Scheduler of the running test, yield points outside of run() do nothing
+    static DeterministicScheduler*& current() {
+        static DeterministicScheduler* scheduler = nullptr;
+        return scheduler;
+    }
+
+    // Run the bodies on their own threads to completion. A run that exceeds the
+    // step budget, e.g. because every thread waits on a latch, aborts the process.
+    void run(std::vector<std::function<void()>> bodies) {
+        current() = this;
+        finished.assign(bodies.size(), false);
+        running = pick();
+        std::vector<std::thread> threads;
+        for (std::size_t i = 0; i < bodies.size(); i++) {
+            threads.emplace_back([this, i, &bodies] {
+                thread_id() = static_cast<int>(i);
+                wait_turn(i);
+                bodies[i]();
+                std::lock_guard<std::mutex> lock(mutex);
+                finished[i] = true;
+                running = pick();
+                turn.notify_all();
+            });
+        }
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
+        current() = nullptr;
+    }
+
+    // Let the scheduler run any thread, possibly this one again
+    void yield() {
+        int id = thread_id();
+        if (id < 0) {
+            return;
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        if (++steps > max_steps) {
+            std::fprintf(stderr, "seed %llu: no progress after %llu steps\n",
+                         static_cast<unsigned long long>(seed), static_cast<unsigned long long>(max_steps));
+            std::abort();
+        }
+        running = pick();
+        turn.notify_all();
+        turn.wait(lock, [&] { return running == static_cast<std::size_t>(id); });
+    }
+
+    uint64_t step_count() const {
+        return steps;
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable turn;
+    uint64_t seed;
+    std::mt19937_64 rng;
+    uint64_t max_steps;
+    uint64_t steps = 0;
+    std::vector<bool> finished;
+    // Thread allowed to run
+    std::size_t running = 0;
+
+    // Index of the calling test thread, -1 outside of run()
+    static int& thread_id() {
+        thread_local int id = -1;
+        return id;
+    }
+
+    void wait_turn(std::size_t id) {
+        std::unique_lock<std::mutex> lock(mutex);
+        turn.wait(lock, [&] { return running == id; });
+    }
+
+    // Random unfinished thread, or finished.size() once all are done
+    std::size_t pick() {
+        std::vector<std::size_t> runnable;
+        for (std::size_t i = 0; i < finished.size(); i++) {
+            if (!finished[i]) {
+                runnable.push_back(i);
+            }
+        }
+        if (runnable.empty()) {
+            return finished.size();
+        }
+        return runnable[std::uniform_int_distribution<std::size_t>(0, runnable.size() - 1)(rng)];
+    }
+};
+
+inline void schedule_point() {
+    if (DeterministicScheduler* scheduler = DeterministicScheduler::current()) {
+        scheduler->yield();
+    }
+}
+
+// Reader/writer latch for scheduled runs. Only the running thread touches it, so
+// plain fields do; waiting is yielding until the latch is free.
+struct ScheduledLatch {
+    uint32_t readers = 0;
+    bool writer = false;
+
+    void lock() {
+        schedule_point();
+        while (writer || readers > 0) {
+            schedule_point();
+        }
+        writer = true;
+    }
+
+    bool try_lock() {
+        schedule_point();
+        if (writer || readers > 0) {
+            return false;
+        }
+        writer = true;
+        return true;
+    }
+
+    void unlock() {
+        writer = false;
+        schedule_point();
+    }
+
+    void lock_shared() {
+        schedule_point();
+        while (writer) {
+            schedule_point();
+        }
+        readers++;
+    }
+
+    bool try_lock_shared() {
+        schedule_point();
+        if (writer) {
+            return false;
+        }
+        readers++;
+        return true;
+    }
+
+    void unlock_shared() {
+        readers--;
+        schedule_point();
+    }
+};
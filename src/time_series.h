@@ -0,0 +1,71 @@
+#pragma once
+#include <cstdint>
+#include <optional>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+
+// Time series stored in a Btree under keys ordered by series and then by time,
+// with time only increasing within a series.
+
+// Appends points, remembering per series the leaf that took its latest point, so
+// the next point of the series usually skips the descent. SeriesFn maps a key to
+// its series id, which must be hashable. One appender per writing thread.
+template<typename TreeT, typename SeriesFn>
+struct TimeSeriesAppender {
+    using KeyT = typename TreeT::Key;
+    using ValueT = typename TreeT::Value;
+    using Series = std::decay_t<std::invoke_result_t<SeriesFn, const KeyT&>>;
+
+    TreeT &tree;
+    SeriesFn series_of;
+    std::unordered_map<Series, typename TreeT::AppendHint> hints;
+    // Appends that went straight to the cached leaf, and all appends
+    uint64_t hits = 0;
+    uint64_t appends = 0;
+
+    // Constructor
+    explicit TimeSeriesAppender(TreeT &tree, SeriesFn series_of = {}) : tree(tree), series_of(series_of) {}
+
+    // key must be later than the last key appended to its series
+    void append(const KeyT &key, const ValueT &value) {
+        appends++;
+        if (tree.append(key, value, hints[series_of(key)])) {
+            hits++;
+        }
+    }
+};
+
+// Scan lo <= key <= hi and fold the entries into buckets. bucket_of(key) names the
+// bucket of a key and must be monotonic in key, for example the series with the
+// minute of the timestamp. Each bucket starts from init and takes fold(acc, key,
+// value) for its entries; emit(bucket, acc) is called once per bucket in key order
+// until it returns false. Folding happens in the scan's leaf loop, so only one
+// accumulator per bucket leaves the tree. emit runs under a leaf latch as in scan.
+template<typename TreeT, typename BucketFn, typename AccT, typename FoldFn, typename EmitFn>
+void rollup(TreeT &tree, const typename TreeT::Key &lo, const typename TreeT::Key &hi, BucketFn &&bucket_of,
+            const AccT &init, FoldFn &&fold, EmitFn &&emit) {
+    using KeyT = typename TreeT::Key;
+    using ValueT = typename TreeT::Value;
+    using BucketT = std::decay_t<std::invoke_result_t<BucketFn&, const KeyT&>>;
+
+    std::optional<BucketT> bucket;
+    AccT acc = init;
+    bool stopped = false;
+    tree.scan(lo, hi, [&](const KeyT &key, const ValueT &value) {
+        BucketT key_bucket = bucket_of(key);
+        if (bucket && !(*bucket == key_bucket)) {
+            if (!emit(*bucket, acc)) {
+                stopped = true;
+                return false;
+            }
+            acc = init;
+        }
+        bucket = std::move(key_bucket);
+        fold(acc, key, value);
+        return true;
+    });
+    if (bucket && !stopped) {
+        emit(*bucket, acc);
+    }
+}
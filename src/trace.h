@@ -0,0 +1,127 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <vector>
+#include <algorithm>
+#include "latency_histogram.h"
+
+// Events recorded by the tracer
+enum class TraceEvent : uint8_t { Split, RootGrow, LatchWait, RootRestart };
+
+inline const char* trace_event_name(TraceEvent event) {
+    static const char* const names[] = {"split", "root_grow", "latch_wait", "root_restart"};
+    return names[static_cast<std::size_t>(event)];
+}
+
+// Process-wide event tracer. Every thread appends to its own ring buffer, so
+// recording is a handful of relaxed stores. Old events are overwritten.
+struct Tracer {
+    static constexpr std::size_t kSlots = 16;
+    static constexpr std::size_t kRingSize = 4096;
+    // Level reported for waits on the tree-wide lock
+    static constexpr uint16_t kGlobalLevel = 0xFFFF;
+
+    // A record is valid when seq is the same non-zero value before and after reading it
+    struct Record {
+        std::atomic<uint64_t> seq{0};
+        std::atomic<uint64_t> start{0};
+        std::atomic<uint64_t> duration{0};
+        std::atomic<uint64_t> meta{0};
+    };
+
+    struct alignas(64) Ring {
+        std::atomic<uint64_t> head{0};
+        Record records[kRingSize];
+    };
+
+    // Latch waits shorter than this are not recorded
+    std::atomic<uint64_t> latch_wait_threshold_ns{10000};
+    std::unique_ptr<Ring[]> rings{new Ring[kSlots]()};
+
+    void record(TraceEvent event, uint16_t level, uint64_t start, uint64_t duration) {
+        unsigned thread = thread_ordinal();
+        Ring &ring = rings[thread % kSlots];
+        uint64_t index = ring.head.fetch_add(1, std::memory_order_relaxed);
+        Record &r = ring.records[index % kRingSize];
+        r.seq.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        r.start.store(start, std::memory_order_relaxed);
+        r.duration.store(duration, std::memory_order_relaxed);
+        r.meta.store(static_cast<uint64_t>(event) | (uint64_t{level} << 8) | (uint64_t{thread} << 32),
+                     std::memory_order_relaxed);
+        r.seq.store(index + 1, std::memory_order_release);
+    }
+
+    // Record a latch wait that started at start if it took long enough
+    void latch_wait(uint16_t level, uint64_t start) {
+        uint64_t duration = now_ns() - start;
+        if (duration >= latch_wait_threshold_ns.load(std::memory_order_relaxed)) {
+            record(TraceEvent::LatchWait, level, start, duration);
+        }
+    }
+
+    // Write all buffered events in Chrome trace event format (chrome://tracing, Perfetto)
+    void dump_chrome_json(std::ostream &out) const {
+        struct Event { uint64_t start, duration, meta; };
+        std::vector<Event> events;
+        for (std::size_t s = 0; s < kSlots; s++) {
+            for (const Record &r : rings[s].records) {
+                uint64_t seq = r.seq.load(std::memory_order_acquire);
+                Event e{r.start.load(std::memory_order_relaxed), r.duration.load(std::memory_order_relaxed),
+                        r.meta.load(std::memory_order_relaxed)};
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (seq != 0 && seq == r.seq.load(std::memory_order_relaxed)) {
+                    events.push_back(e);
+                }
+            }
+        }
+        std::sort(events.begin(), events.end(), [](const Event &a, const Event &b) { return a.start < b.start; });
+
+        // Chrome expects microseconds, keep nanosecond precision as a fraction
+        auto micros = [&out](uint64_t nanos) {
+            char fraction[4] = {char('0' + nanos / 100 % 10), char('0' + nanos / 10 % 10), char('0' + nanos % 10), 0};
+            out << nanos / 1000 << '.' << fraction;
+        };
+
+        out << "{\"traceEvents\":[";
+        const char* sep = "";
+        for (const Event &e : events) {
+            auto event = static_cast<TraceEvent>(e.meta & 0xFF);
+            uint16_t level = static_cast<uint16_t>(e.meta >> 8);
+            out << sep << "{\"name\":\"" << trace_event_name(event) << "\",\"cat\":\"btree\",\"pid\":1"
+                << ",\"tid\":" << (e.meta >> 32) << ",\"ts\":";
+            micros(e.start);
+            if (event == TraceEvent::RootGrow || event == TraceEvent::RootRestart) {
+                out << ",\"ph\":\"i\",\"s\":\"p\"";
+            } else {
+                out << ",\"ph\":\"X\",\"dur\":";
+                micros(e.duration);
+            }
+            out << ",\"args\":{\"level\":";
+            if (level == kGlobalLevel) {
+                out << "\"global\"";
+            } else {
+                out << level;
+            }
+            out << "}}";
+            sep = ",\n";
+        }
+        out << "]}\n";
+    }
+
+    // Drop all buffered events
+    void clear() {
+        for (std::size_t s = 0; s < kSlots; s++) {
+            for (Record &r : rings[s].records) {
+                r.seq.store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+};
+
+inline Tracer& global_tracer() {
+    static Tracer tracer;
+    return tracer;
+}